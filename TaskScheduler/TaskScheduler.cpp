@@ -38,26 +38,46 @@ TaskScheduler& TaskScheduler::Update(size_t const milliseconds, success_t const&
     return Update(std::chrono::milliseconds(milliseconds), callback);
 }
 
-TaskScheduler& TaskScheduler::Async(std::function<void()> const& callable)
+TaskScheduler& TaskScheduler::Async(async_handler_t callable)
 {
-    _asyncHolder.push(callable);
+    if (!_asyncHolder.Push(std::move(callable)))
+        _asyncOverflows.fetch_add(1, std::memory_order_relaxed);
     return *this;
 }
 
+size_t TaskScheduler::GetAsyncOverflowCount() const
+{
+    return _asyncOverflows.load(std::memory_order_relaxed);
+}
+
+size_t TaskScheduler::GetHeapAllocationCount() const
+{
+    return _task_pool->GetHeapAllocationCount() + _task_holder.GetHeapAllocationCount();
+}
+
+auto TaskScheduler::TimeUntilNextTask() const
+    -> clock_t::duration
+{
+    if (!_asyncHolder.IsEmpty())
+        return clock_t::duration::zero();
+
+    if (_task_holder.IsEmpty())
+        return clock_t::duration::max();
+
+    return std::max(_task_holder.First()->_end - clock_t::now(), clock_t::duration::zero());
+}
+
 TaskScheduler& TaskScheduler::CancelAll()
 {
     /// Clear the task holder
     _task_holder.Clear();
-    _asyncHolder = AsyncHolder();
+    _asyncHolder.Clear();
     return *this;
 }
 
 TaskScheduler& TaskScheduler::CancelGroup(group_t const group)
 {
-    _task_holder.RemoveIf([group](TaskContainer const& task) -> bool
-    {
-        return task->IsInGroup(group);
-    });
+    _task_holder.RemoveGroup(group);
     return *this;
 }
 
@@ -82,16 +102,19 @@ void TaskScheduler::Dispatch(success_t const& callback)
         return;
 
     // Process all asyncs
-    while (!_asyncHolder.empty())
+    async_handler_t async;
+    while (_asyncHolder.Pop(async))
     {
-        _asyncHolder.front()();
-        _asyncHolder.pop();
+        async();
+        async = nullptr;
 
         // If the validation failed abort the dispatching here.
         if (!_predicate())
             return;
     }
 
+    _task_holder.Advance(_now);
+
     while (!_task_holder.IsEmpty())
     {
         if (_task_holder.First()->_end > _now)
@@ -113,8 +136,471 @@ void TaskScheduler::Dispatch(success_t const& callback)
     callback();
 }
 
+TaskScheduler::TaskPool::~TaskPool()
+{
+    while (_free)
+    {
+        Block* next = _free->next;
+        ::operator delete(_free);
+        _free = next;
+    }
+}
+
+void* TaskScheduler::TaskPool::Allocate(size_t const size)
+{
+    // All tasks share one type, the first allocation defines the block size
+    if (!_block_size)
+        _block_size = std::max(size, sizeof(Block));
+
+    if (size > _block_size)
+    {
+        ++_heap_allocations;
+        return ::operator new(size);
+    }
+
+    if (_free)
+    {
+        Block* block = _free;
+        _free = block->next;
+        return block;
+    }
+
+    ++_heap_allocations;
+    return ::operator new(_block_size);
+}
+
+void TaskScheduler::TaskPool::Deallocate(void* memory, size_t const size)
+{
+    if (size > _block_size)
+    {
+        ::operator delete(memory);
+        return;
+    }
+
+    Block* block = static_cast<Block*>(memory);
+    block->next = _free;
+    _free = block;
+}
+
+#ifdef TASK_SCHEDULER_TIMING_WHEEL
+
+TaskScheduler::TaskQueue::TaskQueue()
+    : _occupied(), _current(ToTick(clock_t::now())), _size(0), _sequence(0),
+      _free(nullptr), _heap_allocations(0) { }
+
+auto TaskScheduler::TaskQueue::ToTick(timepoint_t const& time)
+    -> tick_t
+{
+    return static_cast<tick_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count());
+}
+
+bool TaskScheduler::TaskQueue::Before(Node const* left, Node const* right)
+{
+    if (*left->task < *right->task)
+        return true;
+    if (*right->task < *left->task)
+        return false;
+    return left->sequence < right->sequence;
+}
+
+auto TaskScheduler::TaskQueue::Allocate(TaskContainer&& task)
+    -> Node*
+{
+    if (!_free)
+    {
+        std::unique_ptr<Node[]> chunk(new Node[NODES_PER_CHUNK]);
+        for (size_t i = 0; i < NODES_PER_CHUNK; ++i)
+        {
+            chunk[i].next = _free;
+            _free = &chunk[i];
+        }
+        _chunks.push_back(std::move(chunk));
+        ++_heap_allocations;
+    }
+
+    Node* node = _free;
+    _free = node->next;
+    node->task = std::move(task);
+    node->prev = nullptr;
+    node->next = nullptr;
+    node->sequence = _sequence++;
+    ++_size;
+    LinkGroup(node);
+    return node;
+}
+
+void TaskScheduler::TaskQueue::Release(Node* node)
+{
+    UnlinkGroup(node);
+    node->task = nullptr;
+    node->prev = nullptr;
+    node->next = _free;
+    _free = node;
+    --_size;
+}
+
+void TaskScheduler::TaskQueue::Link(Node* node)
+{
+    tick_t const tick = ToTick(node->task->_end);
+    if (tick <= _current)
+    {
+        LinkExpired(node);
+        return;
+    }
+
+    // The level is chosen by the highest bit the tick differs from the current tick
+    tick_t const diff = tick ^ _current;
+    unsigned level = 0;
+    while (level < LEVELS && (diff >> (LEVEL_BITS * (level + 1))) != 0)
+        ++level;
+
+    if (level == LEVELS)
+    {
+        Append(OVERFLOW_LIST, node);
+        return;
+    }
+
+    unsigned const slot = (tick >> (LEVEL_BITS * level)) & (SLOTS - 1);
+    _occupied[level] |= std::uint64_t(1) << slot;
+    Append(level * SLOTS + slot, node);
+}
+
+void TaskScheduler::TaskQueue::LinkExpired(Node* node)
+{
+    List& list = _lists[EXPIRED_LIST];
+    node->list = EXPIRED_LIST;
+
+    // Walk from the back, tasks are mostly appended in order
+    Node* after = list.tail;
+    while (after && Before(node, after))
+        after = after->prev;
+
+    node->prev = after;
+    node->next = after ? after->next : list.head;
+    if (node->next)
+        node->next->prev = node;
+    else
+        list.tail = node;
+    if (after)
+        after->next = node;
+    else
+        list.head = node;
+}
+
+void TaskScheduler::TaskQueue::Append(unsigned const list, Node* node)
+{
+    List& target = _lists[list];
+    node->list = list;
+    node->next = nullptr;
+    node->prev = target.tail;
+    if (target.tail)
+        target.tail->next = node;
+    else
+        target.head = node;
+    target.tail = node;
+}
+
+void TaskScheduler::TaskQueue::Unlink(Node* node)
+{
+    List& list = _lists[node->list];
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        list.head = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        list.tail = node->prev;
+
+    if (!list.head && node->list < OVERFLOW_LIST)
+        _occupied[node->list / SLOTS] &= ~(std::uint64_t(1) << (node->list % SLOTS));
+
+    node->prev = nullptr;
+    node->next = nullptr;
+}
+
+void TaskScheduler::TaskQueue::LinkGroup(Node* node)
+{
+    if (!node->task->_grouped)
+        return;
+
+    node->grouped = true;
+    node->group = node->task->_group;
+    if (_groups.find(node->group) == _groups.end())
+        ++_heap_allocations;
+    Node*& head = _groups[node->group];
+    node->group_prev = nullptr;
+    node->group_next = head;
+    if (head)
+        head->group_prev = node;
+    head = node;
+}
+
+void TaskScheduler::TaskQueue::UnlinkGroup(Node* node)
+{
+    if (!node->grouped)
+        return;
+
+    if (node->group_prev)
+        node->group_prev->group_next = node->group_next;
+    else
+        _groups[node->group] = node->group_next;
+    if (node->group_next)
+        node->group_next->group_prev = node->group_prev;
+
+    node->group_prev = nullptr;
+    node->group_next = nullptr;
+    node->grouped = false;
+}
+
+auto TaskScheduler::TaskQueue::Detach(unsigned const list)
+    -> Node*
+{
+    Node* head = _lists[list].head;
+    _lists[list] = List();
+    if (list < OVERFLOW_LIST)
+        _occupied[list / SLOTS] &= ~(std::uint64_t(1) << (list % SLOTS));
+    return head;
+}
+
+void TaskScheduler::TaskQueue::Expire(std::uint64_t slots)
+{
+    while (slots)
+    {
+        unsigned const slot = __builtin_ctzll(slots);
+        slots &= slots - 1;
+
+        for (Node* node = Detach(slot); node;)
+        {
+            Node* next = node->next;
+            LinkExpired(node);
+            node = next;
+        }
+    }
+}
+
+void TaskScheduler::TaskQueue::Cascade(unsigned const list)
+{
+    for (Node* node = Detach(list); node;)
+    {
+        Node* next = node->next;
+        Link(node);
+        node = next;
+    }
+}
+
+auto TaskScheduler::TaskQueue::Earliest() const
+    -> Node*
+{
+    if (_lists[EXPIRED_LIST].head)
+        return _lists[EXPIRED_LIST].head;
+
+    // Lower levels always expire before upper ones,
+    // inside a level the lowest occupied slot comes first.
+    unsigned list = OVERFLOW_LIST;
+    for (unsigned level = 0; level < LEVELS; ++level)
+        if (_occupied[level])
+        {
+            list = level * SLOTS + __builtin_ctzll(_occupied[level]);
+            break;
+        }
+
+    Node* earliest = _lists[list].head;
+    for (Node* node = earliest; node; node = node->next)
+        if (Before(node, earliest))
+            earliest = node;
+    return earliest;
+}
+
 void TaskScheduler::TaskQueue::Push(TaskContainer&& task)
 {
+    Link(Allocate(std::move(task)));
+}
+
+auto TaskScheduler::TaskQueue::Pop()
+    -> TaskContainer
+{
+    Node* node = Earliest();
+    Unlink(node);
+    TaskContainer result = std::move(node->task);
+    Release(node);
+    return result;
+}
+
+auto TaskScheduler::TaskQueue::First() const
+    -> TaskContainer const&
+{
+    return Earliest()->task;
+}
+
+void TaskScheduler::TaskQueue::Advance(timepoint_t const& now)
+{
+    tick_t const target = ToTick(now);
+    while (_current < target)
+    {
+        if ((target >> LEVEL_BITS) == (_current >> LEVEL_BITS))
+        {
+            // Target is inside the current level 0 window
+            Expire(_occupied[0] & ((std::uint64_t(2) << (target & (SLOTS - 1))) - 1));
+            _current = target;
+            return;
+        }
+
+        Expire(_occupied[0]);
+
+        // Jump straight to the next occupied window of an upper level
+        unsigned level = 1;
+        while (level < LEVELS && !_occupied[level])
+            ++level;
+
+        tick_t next;
+        unsigned list = OVERFLOW_LIST;
+        if (level < LEVELS)
+        {
+            unsigned const shift = LEVEL_BITS * level;
+            unsigned const slot = __builtin_ctzll(_occupied[level]);
+            next = ((_current >> (shift + LEVEL_BITS)) << (shift + LEVEL_BITS)) | (tick_t(slot) << shift);
+            list = level * SLOTS + slot;
+        }
+        else if (_lists[OVERFLOW_LIST].head)
+        {
+            unsigned const shift = LEVEL_BITS * LEVELS;
+            next = ((_current >> shift) + 1) << shift;
+        }
+        else
+            next = target + 1;
+
+        if (next > target)
+        {
+            _current = target;
+            return;
+        }
+
+        _current = next;
+        Cascade(list);
+    }
+}
+
+void TaskScheduler::TaskQueue::Clear()
+{
+    for (unsigned list = 0; list < LIST_COUNT; ++list)
+        for (Node* node = Detach(list); node;)
+        {
+            Node* next = node->next;
+            Release(node);
+            node = next;
+        }
+}
+
+void TaskScheduler::TaskQueue::RemoveGroup(group_t const group)
+{
+    auto const itr = _groups.find(group);
+    if (itr == _groups.end())
+        return;
+
+    while (Node* node = itr->second)
+    {
+        Unlink(node);
+        Release(node);
+    }
+}
+
+void TaskScheduler::TaskQueue::ModifyGroup(group_t const group, std::function<bool(TaskContainer const&)> const& filter)
+{
+    auto const itr = _groups.find(group);
+    if (itr == _groups.end())
+        return;
+
+    std::vector<std::pair<timepoint_t, Node*>> cache;
+    for (Node* node = itr->second; node; node = node->group_next)
+    {
+        timepoint_t const end = node->task->_end;
+        if (filter(node->task))
+            cache.emplace_back(end, node);
+    }
+
+    for (auto const& entry : cache)
+        Unlink(entry.second);
+    Relink(cache);
+}
+
+void TaskScheduler::TaskQueue::Regroup(TaskContainer const& task)
+{
+    for (unsigned list = 0; list < LIST_COUNT; ++list)
+        for (Node* node = _lists[list].head; node; node = node->next)
+            if (node->task == task)
+            {
+                UnlinkGroup(node);
+                LinkGroup(node);
+                return;
+            }
+}
+
+void TaskScheduler::TaskQueue::RemoveIf(std::function<bool(TaskContainer const&)> const& filter)
+{
+    for (unsigned list = 0; list < LIST_COUNT; ++list)
+        for (Node* node = _lists[list].head; node;)
+        {
+            Node* next = node->next;
+            if (filter(node->task))
+            {
+                Unlink(node);
+                Release(node);
+            }
+            node = next;
+        }
+}
+
+void TaskScheduler::TaskQueue::ModifyIf(std::function<bool(TaskContainer const&)> const& filter)
+{
+    // Collect the modified nodes with their previous order,
+    // they are linked again in that order like the ordered set does.
+    std::vector<std::pair<timepoint_t, Node*>> cache;
+    for (unsigned list = 0; list < LIST_COUNT; ++list)
+        for (Node* node = _lists[list].head; node;)
+        {
+            Node* next = node->next;
+            timepoint_t const end = node->task->_end;
+            if (filter(node->task))
+            {
+                Unlink(node);
+                cache.emplace_back(end, node);
+            }
+            node = next;
+        }
+
+    Relink(cache);
+}
+
+void TaskScheduler::TaskQueue::Relink(std::vector<std::pair<timepoint_t, Node*>>& nodes)
+{
+    std::sort(nodes.begin(), nodes.end(),
+        [](std::pair<timepoint_t, Node*> const& left, std::pair<timepoint_t, Node*> const& right)
+        {
+            if (left.first != right.first)
+                return left.first < right.first;
+            return left.second->sequence < right.second->sequence;
+        });
+
+    for (auto const& entry : nodes)
+    {
+        entry.second->sequence = _sequence++;
+        Link(entry.second);
+    }
+}
+
+bool TaskScheduler::TaskQueue::IsEmpty() const
+{
+    return _size == 0;
+}
+
+#else
+
+void TaskScheduler::TaskQueue::Push(TaskContainer&& task)
+{
+    // Every tree node is a heap allocation
+    ++_heap_allocations;
     container.insert(task);
 }
 
@@ -161,17 +647,90 @@ void TaskScheduler::TaskQueue::ModifyIf(std::function<bool(TaskContainer const&)
     container.insert(cache.begin(), cache.end());
 }
 
+void TaskScheduler::TaskQueue::RemoveGroup(group_t const group)
+{
+    RemoveIf([group](TaskContainer const& task) -> bool
+    {
+        return task->IsInGroup(group);
+    });
+}
+
+void TaskScheduler::TaskQueue::ModifyGroup(group_t const group, std::function<bool(TaskContainer const&)> const& filter)
+{
+    ModifyIf([&](TaskContainer const& task) -> bool
+    {
+        return task->IsInGroup(group) && filter(task);
+    });
+}
+
 bool TaskScheduler::TaskQueue::IsEmpty() const
 {
     return container.empty();
 }
 
-TaskContext& TaskContext::Dispatch(std::function<TaskScheduler&(TaskScheduler&)> const& apply)
+#endif // TASK_SCHEDULER_TIMING_WHEEL
+
+TaskScheduler::AsyncQueue::AsyncQueue(size_t const capacity)
+    : _mask(capacity - 1), _buffer(new Cell[capacity]), _enqueue_pos(0), _dequeue_pos(0)
 {
-    if (auto const owner = _owner.lock())
-        apply(*owner);
+    if (capacity < 2 || (capacity & _mask) != 0)
+        throw std::logic_error("AsyncQueue capacity must be a power of two");
 
-    return *this;
+    for (size_t i = 0; i < capacity; ++i)
+        _buffer[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+bool TaskScheduler::AsyncQueue::Push(async_handler_t&& callable)
+{
+    Cell* cell;
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        cell = &_buffer[pos & _mask];
+        size_t const seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t const diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            // Claim the slot, on contention pos is reloaded by the CAS
+            if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false; // full
+        else
+            pos = _enqueue_pos.load(std::memory_order_relaxed);
+    }
+
+    cell->callable = std::move(callable);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool TaskScheduler::AsyncQueue::Pop(async_handler_t& callable)
+{
+    Cell& cell = _buffer[_dequeue_pos & _mask];
+    size_t const seq = cell.sequence.load(std::memory_order_acquire);
+    if (seq != _dequeue_pos + 1)
+        return false;
+
+    callable = std::move(cell.callable);
+    cell.callable = nullptr;
+    // Hand the slot back to the producers for the next lap
+    cell.sequence.store(_dequeue_pos + _mask + 1, std::memory_order_release);
+    ++_dequeue_pos;
+    return true;
+}
+
+bool TaskScheduler::AsyncQueue::IsEmpty() const
+{
+    return _buffer[_dequeue_pos & _mask].sequence.load(std::memory_order_acquire) != _dequeue_pos + 1;
+}
+
+void TaskScheduler::AsyncQueue::Clear()
+{
+    async_handler_t callable;
+    while (Pop(callable))
+        callable = nullptr;
 }
 
 bool TaskContext::IsExpired() const
@@ -186,14 +745,15 @@ bool TaskContext::IsInGroup(TaskScheduler::group_t const group) const
 
 TaskContext& TaskContext::SetGroup(TaskScheduler::group_t const group)
 {
-    _task->_group = TaskScheduler::MakeUnique<TaskScheduler::group_t>(group);
-    return *this;
+    _task->_grouped = true;
+    _task->_group = group;
+    return Dispatch(std::bind(&TaskScheduler::RegroupTask, std::placeholders::_1, std::cref(_task)));
 }
 
 TaskContext& TaskContext::ClearGroup()
 {
-    _task->_group = nullptr;
-    return *this;
+    _task->_grouped = false;
+    return Dispatch(std::bind(&TaskScheduler::RegroupTask, std::placeholders::_1, std::cref(_task)));
 }
 
 TaskScheduler::repeated_t TaskContext::GetRepeatCounter() const
@@ -201,7 +761,7 @@ TaskScheduler::repeated_t TaskContext::GetRepeatCounter() const
     return _task->_repeated;
 }
 
-TaskContext& TaskContext::Async(std::function<void()> const& callable)
+TaskContext& TaskContext::Async(TaskScheduler::async_handler_t const& callable)
 {
     return Dispatch(std::bind(&TaskScheduler::Async, std::placeholders::_1, callable));
 }
@@ -224,7 +784,7 @@ TaskContext& TaskContext::CancelGroupsOf(std::vector<TaskScheduler::group_t> con
 void TaskContext::ThrowOnConsumed() const
 {
     // Catch multiple rescheduling caused through bad logic.
-    if (*_consumed)
+    if (!_task || _task->_round != _round || _task->_consumed)
         throw std::logic_error("Bad task logic, task context was consumed already!");
 }
 
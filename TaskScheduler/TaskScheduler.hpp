@@ -19,20 +19,166 @@
 #define _TASK_SCHEDULER_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
-#include <queue>
 #include <memory>
 #include <utility>
 #include <random>
 #include <mutex>
 #include <set>
+#include <unordered_map>
 
 namespace tsc
 {
 
 class TaskContext;
 
+template<typename Signature, size_t Capacity>
+class InplaceFunction;
+
+/// Copyable callable wrapper like std::function which keeps the callable
+/// inside a fixed buffer, so it never allocates.
+/// Callables bigger than the buffer are rejected at compile time.
+template<typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity>
+{
+    struct Operations
+    {
+        R (*invoke)(void*, Args&&...);
+        void (*copy)(void*, void const*);
+        void (*move)(void*, void*);
+        void (*destroy)(void*);
+    };
+
+    template<typename F>
+    struct OperationsOf
+    {
+        static R Invoke(void* storage, Args&&... args)
+        {
+            return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+        }
+
+        static void Copy(void* storage, void const* other)
+        {
+            new (storage) F(*static_cast<F const*>(other));
+        }
+
+        static void Move(void* storage, void* other)
+        {
+            new (storage) F(std::move(*static_cast<F*>(other)));
+        }
+
+        static void Destroy(void* storage)
+        {
+            static_cast<F*>(storage)->~F();
+        }
+
+        static Operations const* Get()
+        {
+            static Operations const operations = { &Invoke, &Copy, &Move, &Destroy };
+            return &operations;
+        }
+    };
+
+    typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type _storage;
+    Operations const* _operations;
+
+public:
+    InplaceFunction()
+        : _operations(nullptr) { }
+
+    InplaceFunction(std::nullptr_t)
+        : _operations(nullptr) { }
+
+    template<typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type>
+    InplaceFunction(F&& callable)
+    {
+        typedef typename std::decay<F>::type callable_t;
+        static_assert(sizeof(callable_t) <= Capacity,
+            "Callable doesn't fit into the InplaceFunction, capture less or capture a pointer");
+        static_assert(alignof(callable_t) <= alignof(std::max_align_t),
+            "Callable is over-aligned for the InplaceFunction");
+
+        new (&_storage) callable_t(std::forward<F>(callable));
+        _operations = OperationsOf<callable_t>::Get();
+    }
+
+    InplaceFunction(InplaceFunction const& right)
+        : _operations(right._operations)
+    {
+        if (_operations)
+            _operations->copy(&_storage, &right._storage);
+    }
+
+    InplaceFunction(InplaceFunction&& right)
+        : _operations(right._operations)
+    {
+        if (_operations)
+            _operations->move(&_storage, &right._storage);
+    }
+
+    ~InplaceFunction()
+    {
+        Reset();
+    }
+
+    InplaceFunction& operator= (InplaceFunction const& right)
+    {
+        if (this != &right)
+        {
+            Reset();
+            if (right._operations)
+                right._operations->copy(&_storage, &right._storage);
+            _operations = right._operations;
+        }
+        return *this;
+    }
+
+    InplaceFunction& operator= (InplaceFunction&& right)
+    {
+        if (this != &right)
+        {
+            Reset();
+            if (right._operations)
+                right._operations->move(&_storage, &right._storage);
+            _operations = right._operations;
+        }
+        return *this;
+    }
+
+    R operator() (Args... args) const
+    {
+        if (!_operations)
+            throw std::bad_function_call();
+
+        return _operations->invoke(const_cast<void*>(static_cast<void const*>(&_storage)),
+            std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const
+    {
+        return _operations != nullptr;
+    }
+
+private:
+    void Reset()
+    {
+        if (_operations)
+        {
+            _operations->destroy(&_storage);
+            _operations = nullptr;
+        }
+    }
+};
+
 /// The TaskScheduler class provides the ability to schedule std::function's in the near future.
 /// Use TaskScheduler::Update to update the scheduler.
 /// Popular methods are:
@@ -54,26 +200,61 @@ class TaskScheduler
     typedef std::chrono::steady_clock clock_t;
     typedef clock_t::time_point timepoint_t;
 
-    // Duration calculator
-    typedef std::function<clock_t::duration()> duration_calculator_t;
+    // Duration calculator, a fixed duration or a random one between min and max
+    // (in steps of the unit min was given in). Stored by value.
+    class DurationCalculator
+    {
+        typedef clock_t::duration::rep rep_t;
+
+        clock_t::duration _min;
+        clock_t::duration _unit;
+        rep_t _steps;
+
+    public:
+        template<typename _Rep, typename _Period>
+        explicit DurationCalculator(std::chrono::duration<_Rep, _Period> const& duration)
+            : _min(std::chrono::duration_cast<clock_t::duration>(duration)),
+              _unit(clock_t::duration::zero()), _steps(0) { }
+
+        template<typename _RepLeft, typename _PeriodLeft, typename _RepRight, typename _PeriodRight>
+        DurationCalculator(std::chrono::duration<_RepLeft, _PeriodLeft> const& min,
+            std::chrono::duration<_RepRight, _PeriodRight> const& max)
+        {
+            using normalized_t = std::chrono::duration<_RepLeft, _PeriodLeft>;
+            auto const normalized = std::chrono::duration_cast<normalized_t>(max);
+
+            if (min.count() > normalized.count())
+                throw std::logic_error("min > max");
+
+            _min = std::chrono::duration_cast<clock_t::duration>(min);
+            _unit = std::chrono::duration_cast<clock_t::duration>(normalized_t(1));
+            _steps = static_cast<rep_t>(normalized.count() - min.count());
+        }
+
+        clock_t::duration operator() () const
+        {
+            if (!_steps)
+                return _min;
+
+            return _min + _unit * RandomDurationBetween(std::chrono::duration<rep_t>(0),
+                std::chrono::duration<rep_t>(_steps)).count();
+        }
+    };
 
     // Static time
     template<typename _Rep, typename _Period>
-    static duration_calculator_t MakeDurationCalculator(std::chrono::duration<_Rep, _Period> const& duration)
+    static DurationCalculator MakeDurationCalculator(std::chrono::duration<_Rep, _Period> const& duration)
     {
-        return [duration]
-        {
-            return duration;
-        };
+        return DurationCalculator(duration);
     }
 
     // Random time between min and max
     template<typename _RepLeft, typename _PeriodLeft, typename _RepRight, typename _PeriodRight>
-    static duration_calculator_t MakeDurationCalculator(
+    static DurationCalculator MakeDurationCalculator(
         std::chrono::duration<_RepLeft, _PeriodLeft> const& min,
         std::chrono::duration<_RepRight, _PeriodRight> const& max)
     {
-        return std::bind(RandomDurationBetween<_RepLeft, _PeriodLeft, _RepRight, _PeriodRight>, min, max);
+        return DurationCalculator(min, max);
     }
 
     // Task group type
@@ -81,45 +262,54 @@ class TaskScheduler
     // Task repeated type
     typedef unsigned int repeated_t;
 
+    /// Inline storage of task handlers, big enough for a few pointers
+    /// or a std::function.
+    static size_t const TASK_HANDLER_CAPACITY = 6 * sizeof(void*);
+
     // Task handle type
-    typedef std::function<void(TaskContext)> task_handler_t;
+    typedef InplaceFunction<void(TaskContext), TASK_HANDLER_CAPACITY> task_handler_t;
+
+    /// Inline storage of asynchronous tasks, big enough for a few pointers
+    /// and a time point.
+    static size_t const ASYNC_HANDLER_CAPACITY = 4 * sizeof(void*) + sizeof(timepoint_t);
+
+    // Asynchronous task type
+    typedef InplaceFunction<void(), ASYNC_HANDLER_CAPACITY> async_handler_t;
     // Predicate type
     typedef std::function<bool()> predicate_t;
     // Success handle type
     typedef std::function<void()> success_t;
 
-    // C++11 std::make_unique workarround
-    template<typename T, typename... Args>
-    static std::unique_ptr<T> MakeUnique(Args&&... args)
-    {
-        return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
-    }
-
     class Task
     {
         friend class TaskContext;
         friend class TaskScheduler;
 
         timepoint_t _end;
-        duration_calculator_t _duration_calculator;
-        std::unique_ptr<group_t> _group;
+        DurationCalculator _duration_calculator;
+        bool _grouped;
+        group_t _group;
         repeated_t _repeated;
         task_handler_t _task;
+        /// Incremented on every dispatch, contexts of older dispatches are consumed
+        std::uint64_t _round;
+        /// Set when the context of the current dispatch was consumed
+        bool _consumed;
 
     public:
         // All Argument construct
-        Task(timepoint_t const& end, duration_calculator_t&& duration_calculator,
+        Task(timepoint_t const& end, DurationCalculator const& duration_calculator,
              group_t const group,
              repeated_t const repeated, task_handler_t const& task)
-                : _end(end), _duration_calculator(std::move(duration_calculator)),
-                  _group(TaskScheduler::MakeUnique<group_t>(group)),
-                  _repeated(repeated), _task(task) { }
+                : _end(end), _duration_calculator(duration_calculator),
+                  _grouped(true), _group(group),
+                  _repeated(repeated), _task(task), _round(0), _consumed(true) { }
 
         // Minimal Argument construct
-        Task(timepoint_t const& end, duration_calculator_t&& duration_calculator,
+        Task(timepoint_t const& end, DurationCalculator const& duration_calculator,
              task_handler_t const& task)
-            : _end(end), _duration_calculator(std::move(duration_calculator)),
-              _group(nullptr), _repeated(0), _task(task) { }
+            : _end(end), _duration_calculator(duration_calculator),
+              _grouped(false), _group(0), _repeated(0), _task(task), _round(0), _consumed(true) { }
 
         // Copy construct
         Task(Task const&) = delete;
@@ -150,7 +340,80 @@ class TaskScheduler
         // Returns true if the task is in the given group
         inline bool IsInGroup(group_t const group) const
         {
-            return _group && (*_group == group);
+            return _grouped && (_group == group);
+        }
+    };
+
+    /// Recycles the memory blocks of tasks, which are allocated together
+    /// with their shared_ptr control block through TaskAllocator.
+    /// Only used from the thread updating the scheduler.
+    class TaskPool
+    {
+        struct Block
+        {
+            Block* next;
+        };
+
+        size_t _block_size;
+        Block* _free;
+        size_t _heap_allocations;
+
+    public:
+        TaskPool()
+            : _block_size(0), _free(nullptr), _heap_allocations(0) { }
+
+        TaskPool(TaskPool const&) = delete;
+        TaskPool& operator= (TaskPool const&) = delete;
+
+        ~TaskPool();
+
+        void* Allocate(size_t const size);
+
+        void Deallocate(void* memory, size_t const size);
+
+        /// Returns the number of blocks that had to be taken from the heap
+        size_t GetHeapAllocationCount() const
+        {
+            return _heap_allocations;
+        }
+    };
+
+    /// Allocator for std::allocate_shared which takes its memory from a TaskPool.
+    /// Every allocator holds a reference to the pool, so the pool outlives all of its tasks.
+    template<typename T>
+    struct TaskAllocator
+    {
+        typedef T value_type;
+
+        std::shared_ptr<TaskPool> pool;
+
+        explicit TaskAllocator(std::shared_ptr<TaskPool> const& pool_)
+            : pool(pool_) { }
+
+        template<typename U>
+        TaskAllocator(TaskAllocator<U> const& other)
+            : pool(other.pool) { }
+
+        T* allocate(size_t const n)
+        {
+            return static_cast<T*>(pool->Allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* memory, size_t const n)
+        {
+            pool->Deallocate(memory, n * sizeof(T));
+        }
+
+        template<typename U>
+        bool operator== (TaskAllocator<U> const& other) const
+        {
+            return pool == other.pool;
+        }
+
+        template<typename U>
+        bool operator!= (TaskAllocator<U> const& other) const
+        {
+            return pool != other.pool;
         }
     };
 
@@ -165,9 +428,138 @@ class TaskScheduler
         };
     };
 
+#ifdef TASK_SCHEDULER_TIMING_WHEEL
+    /// Hierarchical timing wheel with millisecond ticks, 4 levels of 64 slots
+    /// cover about 4.6 hours, tasks beyond that wait in an overflow list.
+    /// Tasks are linked into intrusive list nodes recycled through a free list,
+    /// so inserting or unlinking a task is O(1) and does not touch the heap
+    /// in steady state.
+    /// Tasks whose tick was reached move to an expired list ordered by their end,
+    /// which keeps the dispatch order identical to the std::multiset queue.
+    /// Grouped tasks are additionally linked into a list per group,
+    /// so group operations only touch the tasks of that group.
+    class TaskQueue
+    {
+        static unsigned const LEVEL_BITS = 6;
+        static unsigned const SLOTS = 1 << LEVEL_BITS;
+        static unsigned const LEVELS = 4;
+        static unsigned const OVERFLOW_LIST = LEVELS * SLOTS;
+        static unsigned const EXPIRED_LIST = OVERFLOW_LIST + 1;
+        static unsigned const LIST_COUNT = EXPIRED_LIST + 1;
+        static size_t const NODES_PER_CHUNK = 32;
+
+        typedef std::uint64_t tick_t;
+
+        struct Node
+        {
+            TaskContainer task;
+            Node* prev = nullptr;
+            Node* next = nullptr;
+            unsigned list = 0;
+            /// Insertion order, breaks ties between equal ends like the ordered set does
+            std::uint64_t sequence = 0;
+            /// Group list links, the group is the one the node was indexed with
+            Node* group_prev = nullptr;
+            Node* group_next = nullptr;
+            bool grouped = false;
+            group_t group = 0;
+        };
+
+        struct List
+        {
+            Node* head = nullptr;
+            Node* tail = nullptr;
+        };
+
+        /// Group lists are never erased, so regrouping into a known group doesn't allocate
+        std::unordered_map<group_t, Node*> _groups;
+
+        List _lists[LIST_COUNT];
+        /// Bitmap of non empty slots per level
+        std::uint64_t _occupied[LEVELS];
+        /// The tick the wheel was advanced to
+        tick_t _current;
+        size_t _size;
+        std::uint64_t _sequence;
+
+        std::vector<std::unique_ptr<Node[]>> _chunks;
+        Node* _free;
+        size_t _heap_allocations;
+
+        static tick_t ToTick(timepoint_t const& time);
+
+        static bool Before(Node const* left, Node const* right);
+
+        Node* Allocate(TaskContainer&& task);
+        void Release(Node* node);
+
+        /// Links the node into the slot matching its end
+        void Link(Node* node);
+        /// Links the node into the expired list, ordered by end
+        void LinkExpired(Node* node);
+        void Append(unsigned const list, Node* node);
+        void Unlink(Node* node);
+
+        void LinkGroup(Node* node);
+        void UnlinkGroup(Node* node);
+
+        /// Links unlinked nodes again, ordered by their previous end and insertion order
+        void Relink(std::vector<std::pair<timepoint_t, Node*>>& nodes);
+
+        /// Detaches the whole list and returns its head
+        Node* Detach(unsigned const list);
+        /// Moves all nodes of the given level 0 slots into the expired list
+        void Expire(std::uint64_t slots);
+        /// Redistributes a slot of an upper level after the wheel reached its window
+        void Cascade(unsigned const list);
+
+        Node* Earliest() const;
+
+    public:
+        TaskQueue();
+
+        TaskQueue(TaskQueue const&) = delete;
+        TaskQueue& operator= (TaskQueue const&) = delete;
+
+        // Pushes the task in the container
+        void Push(TaskContainer&& task);
+
+        /// Pops the task out of the container
+        TaskContainer Pop();
+
+        TaskContainer const& First() const;
+
+        /// Moves the wheel forward to the given time
+        void Advance(timepoint_t const& now);
+
+        void Clear();
+
+        void RemoveIf(std::function<bool(TaskContainer const&)> const& filter);
+
+        void ModifyIf(std::function<bool(TaskContainer const&)> const& filter);
+
+        /// Removes all tasks of the group
+        void RemoveGroup(group_t const group);
+
+        /// Like ModifyIf but only visits the tasks of the group
+        void ModifyGroup(group_t const group, std::function<bool(TaskContainer const&)> const& filter);
+
+        /// Updates the group index after the group of a queued task changed
+        void Regroup(TaskContainer const& task);
+
+        bool IsEmpty() const;
+
+        /// Returns the number of node chunks and group lists allocated
+        size_t GetHeapAllocationCount() const
+        {
+            return _heap_allocations;
+        }
+    };
+#else
     class TaskQueue
     {
         std::multiset<TaskContainer, Compare> container;
+        size_t _heap_allocations = 0;
 
     public:
         // Pushes the task in the container
@@ -178,29 +570,90 @@ class TaskScheduler
 
         TaskContainer const& First() const;
 
+        /// The ordered set needs no bookkeeping when time moves
+        void Advance(timepoint_t const&) { }
+
         void Clear();
 
         void RemoveIf(std::function<bool(TaskContainer const&)> const& filter);
 
         void ModifyIf(std::function<bool(TaskContainer const&)> const& filter);
 
+        /// Removes all tasks of the group, scans the whole set
+        void RemoveGroup(group_t const group);
+
+        /// Like ModifyIf but only for tasks of the group, scans the whole set
+        void ModifyGroup(group_t const group, std::function<bool(TaskContainer const&)> const& filter);
+
+        /// The ordered set has no group index
+        void Regroup(TaskContainer const&) { }
+
+        bool IsEmpty() const;
+
+        /// Returns the number of tree nodes allocated so far
+        size_t GetHeapAllocationCount() const
+        {
+            return _heap_allocations;
+        }
+    };
+#endif // TASK_SCHEDULER_TIMING_WHEEL
+
+    /// Bounded multi-producer/single-consumer queue for asynchronous tasks
+    /// (based on Dmitry Vyukov's bounded queue).
+    /// Push may be called from any thread and never blocks, a full queue rejects the task.
+    /// Pop, IsEmpty and Clear must only be called from the thread that updates the scheduler.
+    class AsyncQueue
+    {
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            async_handler_t callable;
+        };
+
+        size_t const _mask;
+        std::unique_ptr<Cell[]> _buffer;
+        std::atomic<size_t> _enqueue_pos;
+        size_t _dequeue_pos;
+
+    public:
+        /// Capacity has to be a power of two
+        explicit AsyncQueue(size_t const capacity);
+
+        AsyncQueue(AsyncQueue const&) = delete;
+        AsyncQueue& operator= (AsyncQueue const&) = delete;
+
+        /// Moves the callable in, returns false if the queue is full
+        bool Push(async_handler_t&& callable);
+
+        /// Moves the oldest callable out, returns false if the queue is empty
+        bool Pop(async_handler_t& callable);
+
         bool IsEmpty() const;
+
+        void Clear();
     };
 
+    /// Maximal number of asynchronous tasks pending between two update ticks.
+    static size_t const ASYNC_QUEUE_CAPACITY = 256;
+
     /// Contains a self reference to track if this object was deleted or not.
     std::shared_ptr<TaskScheduler> self_reference;
 
+    /// Recycles the memory of finished tasks.
+    std::shared_ptr<TaskPool> _task_pool;
+
     /// The current time point (now)
     timepoint_t _now;
 
     /// The Task Queue which contains all task objects.
     TaskQueue _task_holder;
 
-    typedef std::queue<std::function<void()>> AsyncHolder;
-
     /// Contains all asynchronous tasks which will be invoked at
     /// the next update tick.
-    AsyncHolder _asyncHolder;
+    AsyncQueue _asyncHolder;
+
+    /// Counts asynchronous tasks rejected because the queue was full.
+    std::atomic<size_t> _asyncOverflows;
 
     predicate_t _predicate;
 
@@ -215,13 +668,15 @@ class TaskScheduler
 
 public:
     TaskScheduler()
-        : self_reference(this, [](TaskScheduler const*) { }),
-          _now(clock_t::now()), _predicate(EmptyValidator) { }
+        : self_reference(this, [](TaskScheduler const*) { }), _task_pool(std::make_shared<TaskPool>()),
+          _now(clock_t::now()), _asyncHolder(ASYNC_QUEUE_CAPACITY), _asyncOverflows(0),
+          _predicate(EmptyValidator) { }
 
     template<typename P>
     TaskScheduler(P&& predicate)
-        : self_reference(this, [](TaskScheduler const*) { }),
-          _now(clock_t::now()), _predicate(std::forward<P>(predicate)) { }
+        : self_reference(this, [](TaskScheduler const*) { }), _task_pool(std::make_shared<TaskPool>()),
+          _now(clock_t::now()), _asyncHolder(ASYNC_QUEUE_CAPACITY), _asyncOverflows(0),
+          _predicate(std::forward<P>(predicate)) { }
 
     TaskScheduler(TaskScheduler const&) = delete;
     TaskScheduler(TaskScheduler&&) = delete;
@@ -260,7 +715,26 @@ public:
 
     /// Schedule an callable function that is executed at the next update tick.
     /// Its safe to modify the TaskScheduler from within the callable.
-    TaskScheduler& Async(std::function<void()> const& callable);
+    /// Unlike every other method this one may be called from any thread.
+    /// If ASYNC_QUEUE_CAPACITY tasks are pending already the callable is dropped
+    /// and counted, see GetAsyncOverflowCount.
+    /// The callable is stored inline, it can't capture more than ASYNC_HANDLER_CAPACITY bytes.
+    TaskScheduler& Async(async_handler_t callable);
+
+    /// Returns the number of asynchronous tasks dropped because the queue was full.
+    size_t GetAsyncOverflowCount() const;
+
+    /// Returns how often scheduling tasks had to allocate memory from the heap
+    /// (task pool misses and task queue nodes).
+    /// Stays constant once the pools are warm, which makes it usable
+    /// to verify that a code path schedules without allocations.
+    size_t GetHeapAllocationCount() const;
+
+    /// Returns the time left until the next update tick has work to do:
+    /// zero if asynchronous tasks are pending or a task is due already,
+    /// clock_t::duration::max() if nothing is scheduled at all.
+    /// Measured against the real clock, so only meaningful together with Update().
+    clock_t::duration TimeUntilNextTask() const;
 
     /// Schedule an event with a fixed rate.
     /// Never call this from within a task context! Use TaskContext::Schedule instead!
@@ -335,15 +809,10 @@ public:
     template<typename _Rep, typename _Period>
     TaskScheduler& DelayGroup(group_t const group, std::chrono::duration<_Rep, _Period> const& duration)
     {
-        _task_holder.ModifyIf([&duration, group](TaskContainer const& task) -> bool
+        _task_holder.ModifyGroup(group, [&duration](TaskContainer const& task) -> bool
         {
-            if (task->IsInGroup(group))
-            {
-                task->_end += duration;
-                return true;
-            }
-            else
-                return false;
+            task->_end += duration;
+            return true;
         });
         return *this;
     }
@@ -376,10 +845,7 @@ public:
     template<typename _Rep, typename _Period>
     TaskScheduler& RescheduleGroup(group_t const group, std::chrono::duration<_Rep, _Period> const& duration)
     {
-        return RescheduleAtWithPredicate(_now + duration, [&](TaskContainer const& task)
-        {
-            return task->IsInGroup(group);
-        });
+        return RescheduleGroupAt(_now + duration, group);
     }
 
     /// Reschedule all tasks of a group with a random duration between min and max.
@@ -395,21 +861,27 @@ private:
     /// Insert a new task to the enqueued tasks.
     TaskScheduler& InsertTask(TaskContainer task);
 
+    /// Creates a task inside the task pool.
+    template<typename... Args>
+    TaskContainer MakeTask(Args&&... args)
+    {
+        return std::allocate_shared<Task>(TaskAllocator<Task>(_task_pool), std::forward<Args>(args)...);
+    }
+
     TaskScheduler& ScheduleAt(timepoint_t const& end,
-        duration_calculator_t&& duration_calculator, task_handler_t const& task)
+        DurationCalculator const& duration_calculator, task_handler_t const& task)
     {
-        return InsertTask(TaskContainer(new Task(end + duration_calculator(), std::move(duration_calculator), task)));
+        return InsertTask(MakeTask(end + duration_calculator(), duration_calculator, task));
     }
 
     /// Schedule an event with a fixed rate.
     /// Never call this from within a task context! Use TaskContext::schedule instead!
     TaskScheduler& ScheduleAt(timepoint_t const& end,
-        duration_calculator_t&& duration_calculator,
+        DurationCalculator const& duration_calculator,
         group_t const group, task_handler_t const& task)
     {
-        // FIXME Reuse std::unique_ptr
         static repeated_t const DEFAULT_REPEATED = 0;
-        return InsertTask(TaskContainer(new Task(end + duration_calculator(), std::move(duration_calculator), group, DEFAULT_REPEATED, task)));
+        return InsertTask(MakeTask(end + duration_calculator(), duration_calculator, group, DEFAULT_REPEATED, task));
     }
 
     static bool AlwaysTruePredicate(TaskContainer const&)
@@ -422,6 +894,24 @@ private:
         return RescheduleAtWithPredicate(end, AlwaysTruePredicate);
     }
 
+    /// Reschedule all tasks of a group to the given time.
+    TaskScheduler& RescheduleGroupAt(timepoint_t const& end, group_t const group)
+    {
+        _task_holder.ModifyGroup(group, [&end](TaskContainer const& task) -> bool
+        {
+            task->_end = end;
+            return true;
+        });
+        return *this;
+    }
+
+    /// Updates the group index after the group of a task was changed from its context.
+    TaskScheduler& RegroupTask(TaskContainer const& task)
+    {
+        _task_holder.Regroup(task);
+        return *this;
+    }
+
     /// Reschedule all tasks with a given duration relative to the given time.
     TaskScheduler& RescheduleAtWithPredicate(timepoint_t const& end, std::function<bool(TaskContainer const&)> const& predicate)
     {
@@ -481,11 +971,19 @@ class TaskContext
     /// Owner
     std::weak_ptr<TaskScheduler> _owner;
 
-    /// Marks the task as consumed
-    std::shared_ptr<bool> _consumed;
+    /// The dispatch round of the task this context was created for,
+    /// the context is consumed once the task was repeated or dispatched again.
+    std::uint64_t _round;
 
     /// Dispatches an action safe on the TaskScheduler
-    TaskContext& Dispatch(std::function<TaskScheduler&(TaskScheduler&)> const& apply);
+    template<typename F>
+    TaskContext& Dispatch(F const& apply)
+    {
+        if (auto const owner = _owner.lock())
+            apply(*owner);
+
+        return *this;
+    }
 
     // Copy assign
     // TODO Make TaskContext move only
@@ -493,35 +991,38 @@ class TaskContext
     {
         _task = right._task;
         _owner = right._owner;
-        _consumed = right._consumed;
+        _round = right._round;
         return *this;
     }
 
     // Copy construct
     // TODO Make TaskContext move only
     TaskContext(TaskContext const& right)
-        : _task(right._task), _owner(right._owner), _consumed(right._consumed) { }
+        : _task(right._task), _owner(right._owner), _round(right._round) { }
 
 public:
     // Empty constructor
     TaskContext()
-        : _task(), _owner(), _consumed(std::make_shared<bool>(true)) { }
+        : _task(), _owner(), _round(0) { }
 
     // Construct from task and owner
     explicit TaskContext(TaskScheduler::TaskContainer&& task, std::weak_ptr<TaskScheduler>&& owner)
-        : _task(task), _owner(owner), _consumed(std::make_shared<bool>(false)) { }
+        : _task(std::move(task)), _owner(std::move(owner)), _round(++_task->_round)
+    {
+        _task->_consumed = false;
+    }
 
     // Move construct
     TaskContext(TaskContext&& right)
         : _task(std::move(right._task)), _owner(std::move(right._owner)),
-          _consumed(std::move(right._consumed)) { }
+          _round(right._round) { }
 
     // Move assign
     TaskContext& operator= (TaskContext&& right)
     {
         _task = std::move(right._task);
         _owner = std::move(right._owner);
-        _consumed = std::move(right._consumed);
+        _round = right._round;
         return *this;
     }
 
@@ -561,7 +1062,7 @@ public:
         // Set new duration, in-context timing and increment repeat counter
         _task->_end += _task->_duration_calculator();
         _task->_repeated += 1;
-        (*_consumed) = true;
+        _task->_consumed = true;
         return Dispatch(std::bind(&TaskScheduler::InsertTask, std::placeholders::_1, std::cref(_task)));
     }
 
@@ -579,7 +1080,7 @@ public:
 
     /// Schedule a callable function that is executed at the next update tick from within the context.
     /// Its safe to modify the TaskScheduler from within the callable.
-    TaskContext& Async(std::function<void()> const& callable);
+    TaskContext& Async(TaskScheduler::async_handler_t const& callable);
 
     /// Schedule an event with a fixed rate from within the context.
     /// Its possible that the new event is executed immediately!
@@ -698,11 +1199,7 @@ public:
     template<typename _Rep, typename _Period>
     TaskContext& RescheduleGroup(TaskScheduler::group_t const group, std::chrono::duration<_Rep, _Period> const& duration)
     {
-        return Dispatch(std::bind(&TaskScheduler::RescheduleAtWithPredicate, std::placeholders::_1, _task->_end + duration,
-            [&](TaskScheduler::TaskContainer const& task)
-            {
-                return task->IsInGroup(group);
-            }));
+        return Dispatch(std::bind(&TaskScheduler::RescheduleGroupAt, std::placeholders::_1, _task->_end + duration, group));
     }
 
     /// Reschedule all tasks of a group with a random duration between min and max.
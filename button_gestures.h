@@ -0,0 +1,280 @@
+#pragma once
+
+#include <chrono>
+
+// held events can escalate through this many tiers of press duration
+#define MAX_HELD_TIERS 3
+// both buttons pressed together are reported as this extra button
+#define BUTTON_CHORD 2
+#define GESTURE_BUTTON_COUNT 3
+
+// Gesture timings, tunable from wink_manager.ini
+struct GestureTimings {
+  // quiet time after a release before the clicks so far are reported
+  std::chrono::milliseconds clickWindow{150};
+  // press durations at which held tiers 1..n are reported, increasing, 0 ends the list
+  std::chrono::milliseconds heldTiers[MAX_HELD_TIERS] = { std::chrono::milliseconds(400) };
+  // between repeated held events of the current tier, 0 for no repeats
+  std::chrono::milliseconds heldRepeat{400};
+};
+
+enum GestureType {
+  GESTURE_CLICK,
+  GESTURE_HELD,
+  GESTURE_RELEASED
+};
+
+// edge is the press or release edge the gesture was decided on, empty for repeated held events
+struct Gesture {
+  int button;
+  GestureType type;
+  int clicks;
+  int tier;
+  std::chrono::steady_clock::time_point edge;
+};
+
+// Decodes the edges of one button (or the chord of both) into gestures with a fixed
+// transition table. Edges and timeouts are O(1) and nothing is allocated or scheduled,
+// the owner polls for nextDeadline() and calls timeout() once it has passed.
+class GestureDecoder {
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  enum State { IDLE, DOWN, UP, HELD, SUPPRESSED, STATE_COUNT };
+  enum Event { PRESS, RELEASE, TIMEOUT, CANCEL, EVENT_COUNT };
+
+  void init(int button, GestureTimings const* timings) {
+    m_button = button;
+    m_timings = timings;
+  }
+
+  // clicks after which the click is reported on the release edge, 0 to always wait
+  void setMaxClicks(int clicks) {
+    m_maxClicks = clicks > 0 ? clicks : 0;
+  }
+
+  State state() const {
+    return m_state;
+  }
+
+  time_point nextDeadline() const {
+    return m_deadline;
+  }
+
+  template<typename Emit>
+  void press(time_point edge, Emit&& emit) {
+    handle(PRESS, edge, emit);
+  }
+
+  template<typename Emit>
+  void release(time_point edge, Emit&& emit) {
+    handle(RELEASE, edge, emit);
+  }
+
+  // now must be at or past nextDeadline()
+  template<typename Emit>
+  void timeout(Emit&& emit) {
+    handle(TIMEOUT, m_deadline, emit);
+  }
+
+  // the press became part of a chord, drop it and ignore the button until it is released
+  void cancel() {
+    auto ignore = [] (Gesture const&) {};
+    handle(CANCEL, time_point(), ignore);
+  }
+
+private:
+  enum Action {
+    NONE,
+    START_PRESS,    // count the click and wait for the first held tier
+    END_PRESS,      // report the click now if the maximum is reached, else open the click window
+    EMIT_CLICK,
+    EMIT_HELD,      // report the next tier or a repeat and wait for the one after
+    EMIT_RELEASED,
+    RESET
+  };
+
+  struct Transition {
+    State next;
+    Action action;
+  };
+
+  static Transition transition(State state, Event event) {
+    static const Transition table[STATE_COUNT][EVENT_COUNT] = {
+      //                PRESS                  RELEASE                   TIMEOUT                CANCEL
+      /* IDLE */       {{DOWN, START_PRESS},   {IDLE, NONE},             {IDLE, NONE},          {SUPPRESSED, RESET}},
+      /* DOWN */       {{DOWN, NONE},          {UP, END_PRESS},          {HELD, EMIT_HELD},     {SUPPRESSED, RESET}},
+      /* UP */         {{DOWN, START_PRESS},   {UP, NONE},               {IDLE, EMIT_CLICK},    {SUPPRESSED, RESET}},
+      /* HELD */       {{HELD, NONE},          {IDLE, EMIT_RELEASED},    {HELD, EMIT_HELD},     {HELD, NONE}},
+      /* SUPPRESSED */ {{SUPPRESSED, NONE},    {IDLE, RESET},            {SUPPRESSED, NONE},    {SUPPRESSED, NONE}},
+    };
+    return table[state][event];
+  }
+
+  int m_button = 0;
+  GestureTimings const* m_timings = nullptr;
+  int m_maxClicks = 0;
+  State m_state = IDLE;
+  time_point m_deadline = time_point::max();
+  int m_clicks = 0;
+  int m_tier = 0;
+  time_point m_pressEdge;
+  time_point m_releaseEdge;
+  time_point m_lastHeld;
+
+  template<typename Emit>
+  void handle(Event event, time_point t, Emit& emit) {
+    Transition tr = transition(m_state, event);
+    m_state = tr.next;
+    switch (tr.action) {
+    case NONE:
+      break;
+    case START_PRESS:
+      m_clicks++;
+      m_tier = 0;
+      m_pressEdge = t;
+      armHeld();
+      break;
+    case END_PRESS:
+      if ((m_maxClicks && m_clicks >= m_maxClicks) || m_timings->clickWindow.count() == 0) {
+        // no more clicks can follow, don't wait for the window to close
+        emit(Gesture{m_button, GESTURE_CLICK, m_clicks, 0, t});
+        reset();
+      } else {
+        m_releaseEdge = t;
+        m_deadline = t + m_timings->clickWindow;
+      }
+      break;
+    case EMIT_CLICK:
+      emit(Gesture{m_button, GESTURE_CLICK, m_clicks, 0, m_releaseEdge});
+      reset();
+      break;
+    case EMIT_HELD: {
+      bool nextTier = m_tier < MAX_HELD_TIERS && m_timings->heldTiers[m_tier].count() > 0 &&
+                      m_pressEdge + m_timings->heldTiers[m_tier] <= t;
+      if (nextTier) {
+        m_tier++;
+      }
+      emit(Gesture{m_button, GESTURE_HELD, m_clicks, m_tier, nextTier && m_tier == 1 ? m_pressEdge : time_point()});
+      m_lastHeld = t;
+      armHeld();
+      break;
+    }
+    case EMIT_RELEASED:
+      emit(Gesture{m_button, GESTURE_RELEASED, m_clicks, m_tier, t});
+      reset();
+      break;
+    case RESET:
+      reset();
+      break;
+    }
+  }
+
+  // next tier or next repeat of the current one, whichever is first
+  void armHeld() {
+    time_point next = time_point::max();
+    if (m_tier < MAX_HELD_TIERS && m_timings->heldTiers[m_tier].count() > 0) {
+      next = m_pressEdge + m_timings->heldTiers[m_tier];
+    }
+    if (m_tier > 0 && m_timings->heldRepeat.count() > 0 && m_lastHeld + m_timings->heldRepeat < next) {
+      next = m_lastHeld + m_timings->heldRepeat;
+    }
+    m_deadline = next;
+  }
+
+  void reset() {
+    m_clicks = 0;
+    m_tier = 0;
+    m_deadline = time_point::max();
+  }
+};
+
+// The decoders of both buttons plus the chord of the two. A press while the other button
+// is down and not yet held turns both into a chord: their own gestures are dropped and the
+// chord decoder sees a press for as long as both stay down.
+class GestureEngine {
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  GestureEngine() {
+    for (int i = 0; i < GESTURE_BUTTON_COUNT; ++i) {
+      m_decoders[i].init(i, &m_timings);
+    }
+  }
+
+  GestureTimings& timings() {
+    return m_timings;
+  }
+
+  void setMaxClicks(int button, int clicks) {
+    m_decoders[button].setMaxClicks(clicks);
+  }
+
+  void setChords(bool enabled) {
+    m_chords = enabled;
+  }
+
+  template<typename Emit>
+  void press(int button, time_point edge, Emit&& emit) {
+    if (m_down[button]) {
+      return;
+    }
+    m_down[button] = true;
+    if (m_chords) {
+      GestureDecoder& other = m_decoders[!button];
+      GestureDecoder& chord = m_decoders[BUTTON_CHORD];
+      if (m_down[!button] && (other.state() == GestureDecoder::DOWN || other.state() == GestureDecoder::SUPPRESSED)) {
+        other.cancel();
+        m_decoders[button].cancel();
+        chord.press(edge, emit);
+        return;
+      }
+      if (chord.state() != GestureDecoder::IDLE) {
+        // may be the first half of another chord click
+        m_decoders[button].cancel();
+        return;
+      }
+    }
+    m_decoders[button].press(edge, emit);
+  }
+
+  template<typename Emit>
+  void release(int button, time_point edge, Emit&& emit) {
+    if (!m_down[button]) {
+      return;
+    }
+    if (m_chords && m_down[!button]) {
+      GestureDecoder::State state = m_decoders[BUTTON_CHORD].state();
+      if (state == GestureDecoder::DOWN || state == GestureDecoder::HELD) {
+        m_decoders[BUTTON_CHORD].release(edge, emit);
+      }
+    }
+    m_down[button] = false;
+    m_decoders[button].release(edge, emit);
+  }
+
+  template<typename Emit>
+  void expire(time_point now, Emit&& emit) {
+    for (auto& d : m_decoders) {
+      if (d.nextDeadline() <= now) {
+        d.timeout(emit);
+      }
+    }
+  }
+
+  time_point nextDeadline() const {
+    time_point next = time_point::max();
+    for (auto const& d : m_decoders) {
+      if (d.nextDeadline() < next) {
+        next = d.nextDeadline();
+      }
+    }
+    return next;
+  }
+
+private:
+  GestureTimings m_timings;
+  GestureDecoder m_decoders[GESTURE_BUTTON_COUNT];
+  bool m_down[2] = {false, false};
+  bool m_chords = false;
+};
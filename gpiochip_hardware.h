@@ -0,0 +1,203 @@
+#pragma once
+
+#include "hardware.h"
+
+#include <errno.h>
+#include <time.h>
+#include <linux/gpio.h>
+#include <algorithm>
+#include <chrono>
+
+// raw edges read from a line at once
+#define GPIO_EVENT_BATCH 16
+
+// Buttons as line event requests on the gpio character device instead of sysfs. The
+// kernel queues every edge with its timestamp, so edges that come faster than the looper
+// reads are kept and gestures are timed from the edge rather than from when it was read.
+// Contact bounce is filtered on those timestamps. The lines are requested on construction,
+// when that fails (old kernel, no chip, or the line is exported through sysfs) the buttons
+// stay on sysfs and usingChip() is false.
+class GpioChipHardware : public SysfsHardware {
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  explicit GpioChipHardware(std::chrono::milliseconds debounce, const char* chip = BUTTON_GPIO_CHIP)
+  : m_debounce(debounce) {
+    int chipFd = ::open(chip, O_RDONLY);
+    if (chipFd < 0) {
+      m_error = errno;
+      return;
+    }
+    const int lines[] = { BUTTON_0_LINE, BUTTON_1_LINE };
+    for (int i = 0; i < 2; ++i) {
+      m_lines[i].fd = requestLine(chipFd, lines[i]);
+      if (m_lines[i].fd < 0) {
+        m_error = errno;
+        break;
+      }
+    }
+    close(chipFd);
+    if (m_error) {
+      for (auto& line : m_lines) {
+        if (line.fd >= 0) {
+          close(line.fd);
+          line.fd = -1;
+        }
+      }
+      return;
+    }
+    for (auto& line : m_lines) {
+      line.pressed = readLevel(line.fd) == 0;
+    }
+  }
+
+  ~GpioChipHardware() override {
+    for (auto& line : m_lines) {
+      if (line.fd >= 0) {
+        close(line.fd);
+      }
+    }
+  }
+
+  bool usingChip() const {
+    return m_lines[0].fd >= 0;
+  }
+
+  // errno of the failed request when not usingChip()
+  int error() const {
+    return m_error;
+  }
+
+  int buttonFd(int button) override {
+    return usingChip() ? m_lines[button].fd : SysfsHardware::buttonFd(button);
+  }
+
+  short buttonPollEvents() override {
+    return usingChip() ? POLLIN : SysfsHardware::buttonPollEvents();
+  }
+
+  int readButtonEdges(int button, ButtonEdge* edges, int max, time_point now) override {
+    if (!usingChip()) {
+      return SysfsHardware::readButtonEdges(button, edges, max, now);
+    }
+    Line& line = m_lines[button];
+    int count = 0;
+    // a raw edge yields at most two edges and the final settle one more, the rest stay queued
+    int batch = std::min(GPIO_EVENT_BATCH, (max - 1) / 2);
+    struct gpioevent_data raw[GPIO_EVENT_BATCH];
+    ssize_t len = batch > 0 ? read(line.fd, raw, batch * sizeof(raw[0])) : 0;
+    if (len > 0) {
+      ClockOffsets clocks = clockOffsets();
+      for (int i = 0; i < len / (ssize_t)sizeof(raw[0]); ++i) {
+        time_point t = clocks.toSteady(raw[i].timestamp);
+        count += settle(line, t, edges + count);
+        // '0' is pressed, so is the falling edge
+        count += debounce(line, raw[i].id == GPIOEVENT_EVENT_FALLING_EDGE, t, edges + count);
+      }
+    }
+    count += settle(line, now, edges + count);
+    return count;
+  }
+
+  time_point buttonDeadline(int button) override {
+    Line const& line = m_lines[button];
+    return usingChip() && line.pending ? line.accepted + m_debounce : time_point::max();
+  }
+
+protected:
+  void openButtons() override {
+    if (!usingChip()) {
+      SysfsHardware::openButtons();
+    }
+  }
+
+private:
+  struct Line {
+    int fd = -1;
+    bool pressed = false;
+    // last accepted edge, edges closer than the debounce time after it are bounce
+    time_point accepted;
+    // level changed during the bounce window and is accepted if it's still there after it
+    bool pending = false;
+    time_point pendingEdge;
+  };
+
+  // The event timestamps are CLOCK_MONOTONIC since Linux 5.7 and CLOCK_REALTIME before.
+  // steady_clock is CLOCK_MONOTONIC on Linux, so monotonic timestamps map directly and
+  // realtime ones are moved by the offset between the two clocks
+  struct ClockOffsets {
+    int64_t monotonic;
+    int64_t realtime;
+
+    time_point toSteady(uint64_t timestamp) const {
+      int64_t ts = (int64_t)timestamp;
+      if (llabs(ts - realtime) < llabs(ts - monotonic)) {
+        ts += monotonic - realtime;
+      }
+      return time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(ts)));
+    }
+  };
+
+  std::chrono::milliseconds m_debounce;
+  Line m_lines[2];
+  int m_error = 0;
+
+  static int requestLine(int chipFd, int offset) {
+    struct gpioevent_request req;
+    memset(&req, 0, sizeof(req));
+    req.lineoffset = offset;
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+    strncpy(req.consumer_label, "wink_manager", sizeof(req.consumer_label) - 1);
+    if (ioctl(chipFd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+      return -1;
+    }
+    // reads must not block once the pending level is settled by a timeout
+    fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+    return req.fd;
+  }
+
+  static int readLevel(int fd) {
+    struct gpiohandle_data data;
+    memset(&data, 0, sizeof(data));
+    if (ioctl(fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0) {
+      return 1;
+    }
+    return data.values[0];
+  }
+
+  static ClockOffsets clockOffsets() {
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    return ClockOffsets{mono.tv_sec * 1000000000LL + mono.tv_nsec, real.tv_sec * 1000000000LL + real.tv_nsec};
+  }
+
+  int debounce(Line& line, bool pressed, time_point t, ButtonEdge* edge) {
+    if (t - line.accepted < m_debounce) {
+      line.pending = pressed != line.pressed;
+      line.pendingEdge = t;
+      return 0;
+    }
+    line.pending = false;
+    if (pressed == line.pressed) {
+      return 0;
+    }
+    line.pressed = pressed;
+    line.accepted = t;
+    *edge = ButtonEdge{pressed, t};
+    return 1;
+  }
+
+  // accepts a pending level once the bounce window before t has closed
+  int settle(Line& line, time_point t, ButtonEdge* edge) {
+    if (!line.pending || t - line.accepted < m_debounce) {
+      return 0;
+    }
+    line.pending = false;
+    line.pressed = !line.pressed;
+    line.accepted = line.pendingEdge;
+    *edge = ButtonEdge{line.pressed, line.pendingEdge};
+    return 1;
+  }
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <chrono>
+#include <string>
+#include "linux/input.h"
+
+#define BUTTON_0_GPIO "/sys/class/gpio/gpio8/"
+#define BUTTON_1_GPIO "/sys/class/gpio/gpio7/"
+#define RELAY_0_GPIO "/sys/class/gpio/gpio203/"
+#define RELAY_1_GPIO "/sys/class/gpio/gpio204/"
+
+#define SCREEN_STATE  "/sys/class/gpio/gpio30/value"
+#define SCREEN_INPUT_EVENTS "/dev/input/event0"
+#define AMBIENT_LIGHT_IR_INPUT_EVENTS "/dev/input/event1"
+#define AMBIENT_LIGHT_INPUT_EVENTS "/dev/input/event2"
+#define PROXIMITY_INPUT_EVENTS "/dev/input/event3"
+#define	TEMPERATURE_DATA "/sys/bus/i2c/devices/2-0040/temp1_input"
+#define HUMIDITY_DATA "/sys/bus/i2c/devices/2-0040/humidity1_input"
+
+// the button gpios as lines of the gpio character device
+#define BUTTON_GPIO_CHIP "/dev/gpiochip0"
+#define BUTTON_0_LINE 8
+#define BUTTON_1_LINE 7
+
+enum InputDevice {
+  INPUT_TOUCH,
+  INPUT_PROXIMITY,
+  INPUT_AMBIENT_LIGHT,
+  INPUT_AMBIENT_LIGHT_IR,
+  INPUT_DEVICE_COUNT
+};
+
+struct ButtonEdge {
+  bool pressed;
+  std::chrono::steady_clock::time_point time;
+};
+
+inline int writeFile(const char* file, const char* data, int dataLen) {
+  int fd = open(file, O_WRONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = write(fd, data, dataLen);
+  close(fd);
+  return rc;
+}
+
+// Everything WinkRelay touches on the device: button and relay gpios, the screen,
+// the i2c sensors and the input devices. All calls come from the looper thread.
+class Hardware {
+public:
+  virtual ~Hardware() = default;
+
+  // Opens every node, called once by the looper before it starts polling
+  virtual void open() = 0;
+
+  // fd to poll for edges on a button gpio and the poll events that signal one
+  virtual int buttonFd(int button) = 0;
+  virtual short buttonPollEvents() = 0;
+  // Edges queued on a button since the last call, oldest first, at most max of them.
+  // Backends without kernel timestamps stamp them with now
+  virtual int readButtonEdges(int button, ButtonEdge* edges, int max, std::chrono::steady_clock::time_point now) = 0;
+  // when readButtonEdges has an edge to report without a new one arriving, e.g. a debounced level
+  virtual std::chrono::steady_clock::time_point buttonDeadline(int button) {
+    return std::chrono::steady_clock::time_point::max();
+  }
+
+  // '0' or '1', 0 when nothing was read
+  virtual char readRelay(int relay) = 0;
+  virtual void writeRelay(int relay, char state) = 0;
+  virtual char readScreen() = 0;
+  virtual void writeScreen(char state) = 0;
+
+  // thousandths of a degree / percent, -1 when nothing was read
+  virtual int readTemperature() = 0;
+  virtual int readHumidity() = 0;
+
+  // non-blocking fd delivering struct input_event records, -1 when the device isn't used
+  virtual int inputFd(InputDevice device) = 0;
+  virtual bool grabInput(InputDevice device, bool grab) = 0;
+};
+
+// The relay's sysfs gpio/i2c attributes and evdev nodes. root is prepended to every
+// path so the same code can run over a copy of the tree.
+class SysfsHardware : public Hardware {
+public:
+  explicit SysfsHardware(std::string const& root = std::string())
+  : m_root(root) {
+    for (int i = 0; i < INPUT_DEVICE_COUNT; ++i) {
+      m_inputFds[i] = -1;
+    }
+  }
+
+  ~SysfsHardware() override {
+    int* fds[] = { &m_buttonFds[0], &m_buttonFds[1], &m_relayFds[0], &m_relayFds[1], &m_screenFd,
+                   &m_temperatureFd, &m_humidityFd, &m_inputFds[0], &m_inputFds[1], &m_inputFds[2], &m_inputFds[3] };
+    for (int* fd : fds) {
+      if (*fd >= 0) {
+        close(*fd);
+      }
+    }
+  }
+
+  void open() override {
+    openButtons();
+    m_inputFds[INPUT_TOUCH] = openEventSource(path(SCREEN_INPUT_EVENTS), O_RDONLY | O_NONBLOCK);
+    m_inputFds[INPUT_PROXIMITY] = openEventSource(path(PROXIMITY_INPUT_EVENTS), O_RDONLY | O_NONBLOCK);
+    // ambient light (AMBIENT_LIGHT_INPUT_EVENTS, AMBIENT_LIGHT_IR_INPUT_EVENTS) isn't used yet
+
+    m_relayFds[0] = ::open(path(RELAY_0_GPIO"value").c_str(), O_RDWR);
+    m_relayFds[1] = ::open(path(RELAY_1_GPIO"value").c_str(), O_RDWR);
+    m_temperatureFd = ::open(path(TEMPERATURE_DATA).c_str(), O_RDONLY);
+    m_humidityFd = ::open(path(HUMIDITY_DATA).c_str(), O_RDONLY);
+    m_screenFd = ::open(path(SCREEN_STATE).c_str(), O_RDWR);
+  }
+
+  int buttonFd(int button) override {
+    return m_buttonFds[button];
+  }
+
+  // sysfs gpio values report edges as POLLPRI
+  short buttonPollEvents() override {
+    return POLLPRI;
+  }
+
+  // sysfs only has the level now, edges in between are lost
+  int readButtonEdges(int button, ButtonEdge* edges, int max, std::chrono::steady_clock::time_point now) override {
+    char level = readChar(m_buttonFds[button]);
+    if (max < 1 || (level != '0' && level != '1')) {
+      return 0;
+    }
+    edges[0] = ButtonEdge{level == '0', now};
+    return 1;
+  }
+
+  char readRelay(int relay) override {
+    return readChar(m_relayFds[relay]);
+  }
+
+  void writeRelay(int relay, char state) override {
+    writeChar(m_relayFds[relay], state);
+  }
+
+  char readScreen() override {
+    return readChar(m_screenFd);
+  }
+
+  void writeScreen(char state) override {
+    writeChar(m_screenFd, state);
+  }
+
+  int readTemperature() override {
+    return readInteger(m_temperatureFd);
+  }
+
+  int readHumidity() override {
+    return readInteger(m_humidityFd);
+  }
+
+  int inputFd(InputDevice device) override {
+    return m_inputFds[device];
+  }
+
+  bool grabInput(InputDevice device, bool grab) override {
+    return ioctl(m_inputFds[device], EVIOCGRAB, grab ? 1 : 0) == 0;
+  }
+
+protected:
+  std::string m_root;
+
+  std::string path(const char* p) const {
+    return m_root + p;
+  }
+
+  virtual void openButtons() {
+    // set edges to listen to both signals
+    writeFile(path(BUTTON_0_GPIO"edge").c_str(), "both", 4);
+    writeFile(path(BUTTON_1_GPIO"edge").c_str(), "both", 4);
+
+    m_buttonFds[0] = openEventSource(path(BUTTON_0_GPIO"value"), O_RDONLY);
+    m_buttonFds[1] = openEventSource(path(BUTTON_1_GPIO"value"), O_RDONLY);
+  }
+
+  // buttons and input devices, the nodes that are polled for events
+  virtual int openEventSource(std::string const& p, int flags) {
+    return ::open(p.c_str(), flags);
+  }
+
+  static char readChar(int fd) {
+    char buf[2] = {0};
+    lseek(fd, 0, SEEK_SET);
+    if (read(fd, buf, sizeof(buf)) > 0) {
+      return buf[0];
+    }
+    return 0;
+  }
+
+  static void writeChar(int fd, char c) {
+    lseek(fd, 0, SEEK_SET);
+    write(fd, &c, 1);
+  }
+
+  static int readInteger(int fd) {
+    char buf[16] = {0};
+    lseek(fd, 0, SEEK_SET);
+    if (read(fd, buf, sizeof(buf) - 1) > 0) {
+      return atoi(buf);
+    }
+    return -1;
+  }
+
+private:
+  int m_buttonFds[2] = {-1, -1};
+  int m_relayFds[2] = {-1, -1};
+  int m_screenFd = -1;
+  int m_temperatureFd = -1;
+  int m_humidityFd = -1;
+  int m_inputFds[INPUT_DEVICE_COUNT];
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+// Lock-free latency histogram in microseconds, safe to record into from any thread.
+// Buckets are exact below 4us and then split every power of 2 in four, so a reported
+// percentile is at most 25% above the true value. Percentiles are the bucket's upper bound.
+class LatencyHistogram {
+public:
+  struct Summary {
+    uint64_t count = 0;
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t max = 0;
+  };
+
+  void record(std::chrono::steady_clock::duration d) {
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    uint64_t v = us > 0 ? us : 0;
+    m_buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (v > max && !m_max.compare_exchange_weak(max, v, std::memory_order_relaxed)) {
+    }
+  }
+
+  // time since start, start being a steady_clock::now() taken earlier
+  void recordSince(std::chrono::steady_clock::time_point start) {
+    record(std::chrono::steady_clock::now() - start);
+  }
+
+  Summary summary() const {
+    Summary s;
+    uint64_t counts[BUCKETS];
+    for (int i = 0; i < BUCKETS; ++i) {
+      counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+      s.count += counts[i];
+    }
+    s.max = m_max.load(std::memory_order_relaxed);
+    s.p50 = percentile(counts, s.count, 50, s.max);
+    s.p99 = percentile(counts, s.count, 99, s.max);
+    return s;
+  }
+
+private:
+  // 4 exact buckets, then 4 per power of 2 up to 2^35us (about 9.5 hours)
+  static const int BUCKETS = 140;
+
+  std::atomic<uint64_t> m_buckets[BUCKETS] = {};
+  std::atomic<uint64_t> m_max{0};
+
+  static int bucket(uint64_t v) {
+    if (v < 4) {
+      return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    int index = 4 * (e - 1) + (int)((v >> (e - 2)) & 3);
+    return index < BUCKETS ? index : BUCKETS - 1;
+  }
+
+  static uint64_t upperBound(int index) {
+    if (index < 4) {
+      return index;
+    }
+    int e = index / 4 + 1;
+    return ((uint64_t)(5 + index % 4) << (e - 2)) - 1;
+  }
+
+  static uint64_t percentile(const uint64_t* counts, uint64_t total, int p, uint64_t max) {
+    if (total == 0) {
+      return 0;
+    }
+    // rank of the sample at or above p percent, 1 based
+    uint64_t rank = (total * p + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        uint64_t bound = upperBound(i);
+        return bound < max ? bound : max;
+      }
+    }
+    return max;
+  }
+};
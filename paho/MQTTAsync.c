@@ -64,6 +64,8 @@
 #include "OsWrapper.h"
 
 #define URI_TCP "tcp://"
+/** upper bound in milliseconds on how long the receive thread waits when nothing is due */
+#define MQTTASYNC_MAX_RECEIVE_WAIT 60000L
 
 #include "VersionInfo.h"
 
@@ -105,6 +107,7 @@ static thread_id_type sendThread_id = 0,
 static mutex_type mqttasync_mutex = NULL;
 static mutex_type socket_mutex = NULL;
 static mutex_type mqttcommand_mutex = NULL;
+static mutex_type pool_mutex = NULL;
 static sem_type send_sem = NULL;
 extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
@@ -121,6 +124,7 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 			{
 				mqttasync_mutex = CreateMutex(NULL, 0, NULL);
 				mqttcommand_mutex = CreateMutex(NULL, 0, NULL);
+				pool_mutex = CreateMutex(NULL, 0, NULL);
 				send_sem = CreateEvent(
 		        NULL,               /* default security attributes */
 		        FALSE,              /* manual-reset event? */
@@ -151,7 +155,10 @@ static mutex_type socket_mutex = &socket_mutex_store;
 static pthread_mutex_t mqttcommand_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 static mutex_type mqttcommand_mutex = &mqttcommand_mutex_store;
 
-static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t pool_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type pool_mutex = &pool_mutex_store;
+
+static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 0 };
 static cond_type send_cond = &send_cond_store;
 
 void MQTTAsync_init(void)
@@ -171,6 +178,8 @@ void MQTTAsync_init(void)
 		printf("MQTTAsync: error %d initializing command_mutex\n", rc);
 	if ((rc = pthread_mutex_init(socket_mutex, &attr)) != 0)
 		printf("MQTTClient: error %d initializing socket_mutex\n", rc);
+	if ((rc = pthread_mutex_init(pool_mutex, &attr)) != 0)
+		printf("MQTTAsync: error %d initializing pool_mutex\n", rc);
 
 	if ((rc = pthread_cond_init(&send_cond->cond, NULL)) != 0)
 		printf("MQTTAsync: error %d initializing send_cond cond\n", rc);
@@ -185,6 +194,7 @@ static volatile int initialized = 0;
 static List* handles = NULL;
 static int tostop = 0;
 static List* commands = NULL;
+static long batch_delay = 0L; /* milliseconds batched publishes may wait for more */
 
 
 #if defined(WIN32) || defined(WIN64)
@@ -238,6 +248,8 @@ long MQTTAsync_elapsed(struct timeval start)
 }
 #endif
 
+static START_TIME_TYPE batch_start; /* when the first publish in the write batch was queued */
+
 
 typedef struct
 {
@@ -275,6 +287,7 @@ typedef struct
 			void* payload;
 			int qos;
 			int retained;
+			int flags; /* MQTTASYNC_STATIC_TOPIC, MQTTASYNC_STATIC_PAYLOAD: not ours to free */
 		} pub;
 		struct
 		{
@@ -289,6 +302,8 @@ typedef struct
 	} details;
 } MQTTAsync_command;
 
+#define MSGID_WORD_BITS (int)(sizeof(unsigned int) * 8)
+
 
 typedef struct MQTTAsync_struct
 {
@@ -333,6 +348,9 @@ typedef struct MQTTAsync_struct
 	int retrying;
 	int reconnectNow;
 
+	int noBufferedMessages; /* PUBLISH commands for this client in the command queue */
+	unsigned int* msgIDsInUse; /* bit per message id held by a queued or outstanding command */
+
 } MQTTAsyncs;
 
 
@@ -361,11 +379,15 @@ static void MQTTAsync_startConnectRetry(MQTTAsyncs* m);
 static void MQTTAsync_checkDisconnect(MQTTAsync handle, MQTTAsync_command* command);
 static void MQTTProtocol_checkPendingWrites(void);
 static void MQTTAsync_freeServerURIs(MQTTAsyncs* m);
+static MQTTAsync_queuedCommand* MQTTAsync_allocCommand(void);
+static void MQTTAsync_emptyPools(void);
 static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command);
 static void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command);
 static void MQTTAsync_writeComplete(int socket, int rc);
 static int MQTTAsync_processCommand(void);
-static void MQTTAsync_checkTimeouts(void);
+static long MQTTAsync_syncPersistence(void);
+static long MQTTAsync_checkTimeouts(void);
+static void MQTTAsync_wakeSendThread(void);
 static thread_return_type WINAPI MQTTAsync_sendThread(void* n);
 static void MQTTAsync_emptyMessageQueue(Clients* client);
 static void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m);
@@ -379,12 +401,12 @@ static int MQTTAsync_cleanSession(Clients* client);
 static int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm);
 static int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* options, int internal);
 static int MQTTAsync_disconnect_internal(MQTTAsync handle, int timeout);
-static int cmdMessageIDCompare(void* a, void* b);
 static int MQTTAsync_assignMsgId(MQTTAsyncs* m);
-static int MQTTAsync_countBufferedMessages(MQTTAsyncs* m);
+static void MQTTAsync_setMsgIdInUse(MQTTAsyncs* m, int msgid, int inuse);
 static void MQTTAsync_retry(void);
 static int MQTTAsync_connecting(MQTTAsyncs* m);
 static MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc);
+static long MQTTAsync_receiveTimeout(void);
 /*static int pubCompare(void* a, void* b);*/
 
 
@@ -516,6 +538,8 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 #endif
 	m->serverURI = MQTTStrdup(serverURI);
 	m->responses = ListInitialize();
+	m->msgIDsInUse = malloc((MAX_MSG_ID / MSGID_WORD_BITS + 1) * sizeof(unsigned int));
+	memset(m->msgIDsInUse, '\0', (MAX_MSG_ID / MSGID_WORD_BITS + 1) * sizeof(unsigned int));
 	ListAppend(handles, m, sizeof(MQTTAsyncs));
 
 	m->c = malloc(sizeof(Clients));
@@ -575,6 +599,7 @@ static void MQTTAsync_terminate(void)
 			MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*)(elem->content));
 		ListFree(commands);
 		handles = NULL;
+		MQTTAsync_emptyPools();
 		Socket_outTerminate();
 #if defined(OPENSSL)
 		SSLSocket_terminate();
@@ -719,8 +744,7 @@ static MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int bufle
 	size_t data_size;
 
 	FUNC_ENTRY;
-	qcommand = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(qcommand, '\0', sizeof(MQTTAsync_queuedCommand));
+	qcommand = MQTTAsync_allocCommand();
 	command = &qcommand->command;
 
 	command->type = *(int*)ptr;
@@ -852,6 +876,9 @@ static int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 					cmd->client = client;
 					cmd->seqno = atoi(msgkeys[i]+2);
 					MQTTPersistence_insertInOrder(commands, cmd, sizeof(MQTTAsync_queuedCommand));
+					if (cmd->command.type == PUBLISH)
+						client->noBufferedMessages++;
+					MQTTAsync_setMsgIdInUse(client, cmd->command.token, 1);
 					free(buffer);
 					client->command_seqno = max(client->command_seqno, cmd->seqno);
 					commands_restored++;
@@ -896,6 +923,8 @@ static int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_si
 	else
 	{
 		ListAppend(commands, command, command_size);
+		if (command->command.type == PUBLISH)
+			command->client->noBufferedMessages++;
 #if !defined(NO_PERSISTENCE)
 		if (command->client->c->persistence)
 			MQTTAsync_persistCommand(command);
@@ -915,6 +944,20 @@ static int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_si
 }
 
 
+/**
+ * Wake the send thread so it processes queued commands and works out its next timeout again
+ */
+static void MQTTAsync_wakeSendThread(void)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	Thread_signal_cond(send_cond);
+#else
+	if (!Thread_check_sem(send_sem))
+		Thread_post_sem(send_sem);
+#endif
+}
+
+
 static void MQTTAsync_startConnectRetry(MQTTAsyncs* m)
 {
 	if (m->automaticReconnect && m->shouldBeConnected)
@@ -927,6 +970,7 @@ static void MQTTAsync_startConnectRetry(MQTTAsyncs* m)
 			m->currentInterval = m->minRetryInterval;
 			m->retrying = 1;
 		}
+		MQTTAsync_wakeSendThread(); /* the reconnect deadline may be earlier than the one it is waiting for */
 	}
 }
 
@@ -949,14 +993,14 @@ int MQTTAsync_reconnect(MQTTAsync handle)
 	  			m->currentInterval = m->minRetryInterval;
 	  			m->retrying = 1;
 	  		}
+			MQTTAsync_wakeSendThread();
 	  		rc = MQTTASYNC_SUCCESS;
 		}
 	}
 	else
 	{
 		/* to reconnect, put the connect command to the head of the command queue */
-		MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
-		memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+		MQTTAsync_queuedCommand* conn = MQTTAsync_allocCommand();
 		conn->client = m;
 		conn->command = m->connect;
 		/* make sure that the version attempts are restarted */
@@ -1053,8 +1097,178 @@ static void MQTTAsync_freeServerURIs(MQTTAsyncs* m)
 }
 
 
+/*
+ * Queued commands, publish payloads and topics are recycled through free lists rather than going
+ * back to the heap after every publish.  Each block is still an ordinary malloc'd block, so code
+ * that frees a command directly (ListFree and friends) stays correct, the block just isn't recycled.
+ */
+#define MQTTASYNC_POOL_MAX_FREE 32 /* blocks kept on each free list */
+#define MQTTASYNC_POOLED_TOPIC 0x100 /* internal pub.flags: topic came from MQTTAsync_allocBuffer */
+#define MQTTASYNC_POOLED_PAYLOAD 0x200 /* internal pub.flags: payload came from MQTTAsync_allocBuffer */
+
+typedef struct pool_block
+{
+	struct pool_block* next;
+} pool_block;
+
+typedef struct
+{
+	pool_block* first;
+	int count;
+} pool_list;
+
+static const size_t pool_buffer_sizes[] = {16, 64, 256, 1024};
+#define MQTTASYNC_BUFFER_CLASSES (int)(sizeof(pool_buffer_sizes) / sizeof(pool_buffer_sizes[0]))
+
+static pool_list command_pool = {NULL, 0};
+static pool_list buffer_pools[MQTTASYNC_BUFFER_CLASSES];
+static MQTTAsync_poolStats pool_stats;
+
+static int MQTTAsync_bufferClass(size_t size)
+{
+	int i;
+
+	for (i = 0; i < MQTTASYNC_BUFFER_CLASSES; ++i)
+	{
+		if (size <= pool_buffer_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+
+static void* MQTTAsync_poolGet(pool_list* pool, size_t size, unsigned long* hits, unsigned long* misses)
+{
+	void* block = NULL;
+
+	Thread_lock_mutex(pool_mutex);
+	if (pool->first)
+	{
+		block = pool->first;
+		pool->first = pool->first->next;
+		--(pool->count);
+		++(*hits);
+	}
+	else
+		++(*misses);
+	Thread_unlock_mutex(pool_mutex);
+	if (block == NULL)
+		block = malloc(size);
+	return block;
+}
+
+
+static void MQTTAsync_poolPut(pool_list* pool, void* block)
+{
+	Thread_lock_mutex(pool_mutex);
+	if (pool->count < MQTTASYNC_POOL_MAX_FREE)
+	{
+		((pool_block*)block)->next = pool->first;
+		pool->first = (pool_block*)block;
+		++(pool->count);
+		block = NULL;
+	}
+	Thread_unlock_mutex(pool_mutex);
+	if (block)
+		free(block);
+}
+
+
+static MQTTAsync_queuedCommand* MQTTAsync_allocCommand(void)
+{
+	MQTTAsync_queuedCommand* command = MQTTAsync_poolGet(&command_pool, sizeof(MQTTAsync_queuedCommand),
+			&pool_stats.commandHits, &pool_stats.commandMisses);
+
+	memset(command, '\0', sizeof(MQTTAsync_queuedCommand));
+	return command;
+}
+
+
+/**
+ * Get a buffer of at least size bytes, from the free list of its size class if possible.
+ * Buffers bigger than the largest class come straight from the heap.
+ */
+static void* MQTTAsync_allocBuffer(size_t size)
+{
+	int i = MQTTAsync_bufferClass(size);
+
+	if (i < 0)
+	{
+		Thread_lock_mutex(pool_mutex);
+		++(pool_stats.bufferMisses);
+		Thread_unlock_mutex(pool_mutex);
+		return malloc(size);
+	}
+	return MQTTAsync_poolGet(&buffer_pools[i], pool_buffer_sizes[i], &pool_stats.bufferHits, &pool_stats.bufferMisses);
+}
+
+
+/**
+ * Give back a buffer from MQTTAsync_allocBuffer.  size is the size it was asked for, or anything
+ * smaller: the buffer goes back to a class no bigger than the one it came from.
+ */
+static void MQTTAsync_freeBuffer(void* buffer, size_t size)
+{
+	int i = MQTTAsync_bufferClass(size);
+
+	if (buffer == NULL)
+		return;
+	if (i < 0)
+		free(buffer);
+	else
+		MQTTAsync_poolPut(&buffer_pools[i], buffer);
+}
+
+
+static void MQTTAsync_emptyPools(void)
+{
+	pool_list* pools[MQTTASYNC_BUFFER_CLASSES + 1];
+	int i;
+
+	pools[0] = &command_pool;
+	for (i = 0; i < MQTTASYNC_BUFFER_CLASSES; ++i)
+		pools[i + 1] = &buffer_pools[i];
+	Thread_lock_mutex(pool_mutex);
+	for (i = 0; i < MQTTASYNC_BUFFER_CLASSES + 1; ++i)
+	{
+		while (pools[i]->first)
+		{
+			pool_block* block = pools[i]->first;
+			pools[i]->first = block->next;
+			free(block);
+		}
+		pools[i]->count = 0;
+	}
+	Thread_unlock_mutex(pool_mutex);
+}
+
+
+void MQTTAsync_getPoolStats(MQTTAsync_poolStats* stats)
+{
+	int i;
+
+	Thread_lock_mutex(pool_mutex);
+	*stats = pool_stats;
+	stats->commandsFree = command_pool.count;
+	stats->buffersFree = 0;
+	for (i = 0; i < MQTTASYNC_BUFFER_CLASSES; ++i)
+		stats->buffersFree += buffer_pools[i].count;
+	Thread_unlock_mutex(pool_mutex);
+}
+
+
+void* MQTTAsync_mallocPayload(size_t size)
+{
+	return MQTTAsync_allocBuffer(size);
+}
+
+
 static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 {
+	if (command->client && command->command.token > 0 && (command->command.type == PUBLISH ||
+			command->command.type == SUBSCRIBE || command->command.type == UNSUBSCRIBE))
+		MQTTAsync_setMsgIdInUse(command->client, command->command.token, 0);
+
 	if (command->command.type == SUBSCRIBE)
 	{
 		int i;
@@ -1079,11 +1293,23 @@ static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 	}
 	else if (command->command.type == PUBLISH)
 	{
+		int flags = command->command.details.pub.flags;
+
 		/* qos 1 and 2 topics are freed in the protocol code when the flows are completed */
-		if (command->command.details.pub.destinationName)
+		if (command->command.details.pub.destinationName == NULL || (flags & MQTTASYNC_STATIC_TOPIC))
+			;
+		else if (flags & MQTTASYNC_POOLED_TOPIC)
+			MQTTAsync_freeBuffer(command->command.details.pub.destinationName,
+					strlen(command->command.details.pub.destinationName) + 1);
+		else
 			free(command->command.details.pub.destinationName);
 		command->command.details.pub.destinationName = NULL;
-		free(command->command.details.pub.payload);
+		if (flags & MQTTASYNC_STATIC_PAYLOAD)
+			;
+		else if (flags & MQTTASYNC_POOLED_PAYLOAD)
+			MQTTAsync_freeBuffer(command->command.details.pub.payload, command->command.details.pub.payloadlen);
+		else
+			free(command->command.details.pub.payload);
 		command->command.details.pub.payload = NULL;
 	}
 }
@@ -1091,7 +1317,7 @@ static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 static void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command)
 {
 	MQTTAsync_freeCommand1(command);
-	free(command);
+	MQTTAsync_poolPut(&command_pool, command);
 }
 
 
@@ -1162,6 +1388,7 @@ static void MQTTAsync_writeComplete(int socket, int rc)
 			m->pending_write = NULL;
 		}
 	}
+	MQTTAsync_wakeSendThread(); /* commands held back by the pending write can go now */
 	FUNC_EXIT;
 }
 
@@ -1211,6 +1438,8 @@ static int MQTTAsync_processCommand(void)
 	if (command)
 	{
 		ListDetach(commands, command);
+		if (command->command.type == PUBLISH)
+			command->client->noBufferedMessages--;
 #if !defined(NO_PERSISTENCE)
 		if (command->client->c->persistence)
 			MQTTAsync_unpersistCommand(command);
@@ -1309,7 +1538,14 @@ static int MQTTAsync_processCommand(void)
 		p->topic = command->command.details.pub.destinationName;
 		p->msgId = command->command.token;
 
+#if defined(OPENSSL)
+		if (command->client->c->net.ssl == NULL)
+#endif
+			Socket_batchWrites(command->client->c->net.socket);
 		rc = MQTTProtocol_startPublish(command->client->c, p, command->command.details.pub.qos, command->command.details.pub.retained, &msg);
+		Socket_batchWrites(0);
+		if (Socket_batchCount() == 1)
+			batch_start = MQTTAsync_start_clock();
 
 		if (command->command.details.pub.qos == 0)
 		{
@@ -1443,8 +1679,7 @@ static void nextOrClose(MQTTAsyncs* m, int rc, char* message)
 
 		MQTTAsync_closeOnly(m->c);
 		/* put the connect command back to the head of the command queue, using the next serverURI */
-		conn = malloc(sizeof(MQTTAsync_queuedCommand));
-		memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+		conn = MQTTAsync_allocCommand();
 		conn->client = m;
 		conn->command = m->connect;
 		Log(TRACE_MIN, -1, "Connect failed, more to try");
@@ -1480,19 +1715,50 @@ static void nextOrClose(MQTTAsyncs* m, int rc, char* message)
 }
 
 
-static void MQTTAsync_checkTimeouts(void)
+/**
+ * The earlier of two timeouts in milliseconds, where -1 is no timeout
+ */
+static long MQTTAsync_nextDeadline(long next, long timeout)
+{
+	return (next < 0 || timeout < next) ? timeout : next;
+}
+
+
+/**
+ * Sync the persistence of the clients that is due it.  Persistence that batches its syncs
+ * otherwise only syncs when it is next written to, which may not be for a long time.
+ * Must be called with mqttasync_mutex held.
+ * @return the milliseconds until the next sync is due, -1 if none is waiting
+ */
+static long MQTTAsync_syncPersistence(void)
 {
 	ListElement* current = NULL;
-	static time_t last = 0L;
-	time_t now;
+	long next = -1L;
 
-	FUNC_ENTRY;
-	time(&(now));
-	if (difftime(now, last) < 3)
-		goto exit;
+	while (ListNextElement(handles, &current))
+	{
+		long due = MQTTPersistence_sync(((MQTTAsyncs*)(current->content))->c);
+
+		if (due >= 0)
+			next = MQTTAsync_nextDeadline(next, due);
+	}
+	return next;
+}
 
+
+/**
+ * Handle the connect, disconnect and automatic reconnect timeouts that have expired,
+ * and the persistence syncs that are due.
+ * @return the milliseconds until the next of those deadlines, -1 if there is none
+ */
+static long MQTTAsync_checkTimeouts(void)
+{
+	ListElement* current = NULL;
+	long next = -1L;
+
+	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
-	last = now;
+	next = MQTTAsync_syncPersistence();
 	while (ListNextElement(handles, &current))		/* for each client */
 	{
 		ListElement* cur_response = NULL;
@@ -1503,13 +1769,27 @@ static void MQTTAsync_checkTimeouts(void)
 
 		/* check disconnect timeout */
 		if (m->c->connect_state == -2)
+		{
 			MQTTAsync_checkDisconnect(m, &m->disconnect);
+			if (m->c->connect_state == -2)
+			{
+				/* also waiting for the in-flight messages to complete, which isn't signalled */
+				long left = m->disconnect.details.dis.timeout - MQTTAsync_elapsed(m->disconnect.start_time);
+				next = MQTTAsync_nextDeadline(next, min(max(left, 0L), 1000L));
+			}
+		}
 
 		/* check connect timeout */
-		if (m->c->connect_state != 0 && MQTTAsync_elapsed(m->connect.start_time) > (m->connectTimeout * 1000))
+		if (m->c->connect_state != 0)
 		{
-			nextOrClose(m, MQTTASYNC_FAILURE, "TCP connect timeout");
-			continue;
+			long left = (m->connectTimeout * 1000L) - (long)MQTTAsync_elapsed(m->connect.start_time);
+
+			if (left < 0)
+			{
+				nextOrClose(m, MQTTASYNC_FAILURE, "TCP connect timeout");
+				continue;
+			}
+			next = MQTTAsync_nextDeadline(next, left + 1);
 		}
 
 		timed_out_count = 0;
@@ -1536,11 +1816,12 @@ static void MQTTAsync_checkTimeouts(void)
 
 		if (m->automaticReconnect && m->retrying)
 		{
-			if (m->reconnectNow || MQTTAsync_elapsed(m->lastConnectionFailedTime) > (m->currentInterval * 1000))
+			long left = (m->currentInterval * 1000L) - (long)MQTTAsync_elapsed(m->lastConnectionFailedTime);
+
+			if (m->reconnectNow || left < 0)
 			{
 				/* to reconnect put the connect command to the head of the command queue */
-				MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
-				memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+				MQTTAsync_queuedCommand* conn = MQTTAsync_allocCommand();
 				conn->client = m;
 				conn->command = m->connect;
 	  			/* make sure that the version attempts are restarted */
@@ -1549,12 +1830,42 @@ static void MQTTAsync_checkTimeouts(void)
 				Log(TRACE_MIN, -1, "Automatically attempting to reconnect");
 				MQTTAsync_addCommand(conn, sizeof(m->connect));
 				m->reconnectNow = 0;
+				/* don't queue another attempt before this one has had its interval */
+				m->lastConnectionFailedTime = MQTTAsync_start_clock();
+				left = m->currentInterval * 1000L;
 			}
+			next = MQTTAsync_nextDeadline(next, left + 1);
 		}
 	}
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
-exit:
 	FUNC_EXIT;
+	return next;
+}
+
+
+/**
+ * Write out the publishes batched by MQTTAsync_processCommand, unless the batching delay
+ * says to wait for more.
+ * @return the number of milliseconds left to wait before flushing, 0 if nothing is waiting
+ */
+static long MQTTAsync_flushBatch(void)
+{
+	long wait = 0L;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	if (Socket_batchCount() > 0)
+	{
+		long elapsed = MQTTAsync_elapsed(batch_start);
+
+		if (elapsed < batch_delay)
+			wait = batch_delay - elapsed;
+		else
+			Socket_flushBatch();
+	}
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	FUNC_EXIT;
+	return wait;
 }
 
 
@@ -1569,20 +1880,32 @@ static thread_return_type WINAPI MQTTAsync_sendThread(void* n)
 	{
 		int rc;
 
+		long wait;
+		long timeout;
+
 		while (commands->count > 0)
 		{
 			if (MQTTAsync_processCommand() == 0)
 				break;  /* no commands were processed, so go into a wait */
 		}
+		if ((wait = MQTTAsync_flushBatch()) > 0)
+		{ /* give more publishes the chance to join the batch */
+			MQTTAsync_sleep(wait);
+			continue;
+		}
+		/* sleep until signalled for a new command or the next connect/reconnect deadline */
+		timeout = MQTTAsync_checkTimeouts();
+		if (timeout == 0 || tostop)
+			continue;
+		if (commands->count > 0 && (timeout < 0 || timeout > 1000L))
+			timeout = 1000L; /* held back for a reason that isn't signalled, e.g. no free message ids */
 #if !defined(WIN32) && !defined(WIN64)
-		if ((rc = Thread_wait_cond(send_cond, 1)) != 0 && rc != ETIMEDOUT)
+		if ((rc = Thread_wait_cond(send_cond, timeout)) != 0 && rc != ETIMEDOUT)
 			Log(LOG_ERROR, -1, "Error %d waiting for condition variable", rc);
 #else
-		if ((rc = Thread_wait_sem(send_sem, 1000)) != 0 && rc != ETIMEDOUT)
+		if ((rc = Thread_wait_sem(send_sem, timeout)) != 0 && rc != ETIMEDOUT)
 			Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
 #endif
-
-		MQTTAsync_checkTimeouts();
 	}
 	sendThread_state = STOPPING;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
@@ -1660,6 +1983,8 @@ static void MQTTAsync_removeResponsesAndCommands(MQTTAsyncs* m)
 		if (command->client == m)
 		{
 			ListDetach(commands, command);
+			if (command->command.type == PUBLISH)
+				m->noBufferedMessages--;
 
 			if (command->command.onFailure)
 			{
@@ -1699,6 +2024,7 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 
 	MQTTAsync_removeResponsesAndCommands(m);
 	ListFree(m->responses);
+	free(m->msgIDsInUse);
 
 	if (m->c)
 	{
@@ -1817,7 +2143,7 @@ static thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 		MQTTAsync_lock_mutex(mqttasync_mutex);
 		if (tostop)
 			break;
-		timeout = 1000L;
+		timeout = MQTTAsync_receiveTimeout();
 
 		if (sock == 0)
 			continue;
@@ -2043,6 +2369,8 @@ static void MQTTAsync_stop(void)
 		{
 			int count = 0;
 			tostop = 1;
+			Socket_wake();
+			MQTTAsync_wakeSendThread();
 			while ((sendThread_state != STOPPED || receiveThread_state != STOPPED) && ++count < 100)
 			{
 				MQTTAsync_unlock_mutex(mqttasync_mutex);
@@ -2495,8 +2823,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	}
 
 	/* Add connect request to operation queue */
-	conn = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+	conn = MQTTAsync_allocCommand();
 	conn->client = m;
 	if (options)
 	{
@@ -2535,8 +2862,7 @@ static int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOpt
 	}
 
 	/* Add disconnect request to operation queue */
-	dis = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(dis, '\0', sizeof(MQTTAsync_queuedCommand));
+	dis = MQTTAsync_allocCommand();
 	dis->client = m;
 	if (options)
 	{
@@ -2591,16 +2917,21 @@ int MQTTAsync_isConnected(MQTTAsync handle)
 }
 
 
-static int cmdMessageIDCompare(void* a, void* b)
+static void MQTTAsync_setMsgIdInUse(MQTTAsyncs* m, int msgid, int inuse)
 {
-	MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)a;
-	return cmd->command.token == *(int*)b;
+	if (msgid <= 0 || msgid > MAX_MSG_ID)
+		return;
+	if (inuse)
+		m->msgIDsInUse[msgid / MSGID_WORD_BITS] |= 1U << (msgid % MSGID_WORD_BITS);
+	else
+		m->msgIDsInUse[msgid / MSGID_WORD_BITS] &= ~(1U << (msgid % MSGID_WORD_BITS));
 }
 
 
 /**
  * Assign a new message id for a client.  Make sure it isn't already being used and does
- * not exceed the maximum.
+ * not exceed the maximum.  Ids held by commands on the command queue or response list are
+ * tracked in the client's msgIDsInUse bitmap, from assignment until the command is freed.
  * @param m a client structure
  * @return the next message id to use, or 0 if none available
  */
@@ -2608,10 +2939,10 @@ static int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 {
 	int start_msgid = m->c->msgID;
 	int msgid = start_msgid;
+	int tries = 0;
 	thread_id_type thread_id = 0;
 	int locked = 0;
 
-	/* need to check: commands list and response list for a client */
 	FUNC_ENTRY;
 	/* We might be called in a callback. In which case, this mutex will be already locked. */
 	thread_id = Thread_getid();
@@ -2621,19 +2952,24 @@ static int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 		locked = 1;
 	}
 
-	msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-	while (ListFindItem(commands, &msgid, cmdMessageIDCompare) ||
-			ListFindItem(m->responses, &msgid, cmdMessageIDCompare))
+	for (tries = 0; tries < MAX_MSG_ID; ++tries)
 	{
 		msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-		if (msgid == start_msgid)
-		{ /* we've tried them all - none free */
-			msgid = 0;
-			break;
+		if (msgid % MSGID_WORD_BITS == 0 && m->msgIDsInUse[msgid / MSGID_WORD_BITS] == ~0U)
+		{ /* skip a word of ids that are all taken */
+			msgid += MSGID_WORD_BITS - 1;
+			tries += MSGID_WORD_BITS - 1;
 		}
+		else if ((m->msgIDsInUse[msgid / MSGID_WORD_BITS] & (1U << (msgid % MSGID_WORD_BITS))) == 0)
+			break;
 	}
-	if (msgid != 0)
+	if (tries >= MAX_MSG_ID)
+		msgid = 0; /* we've tried them all - none free */
+	else
+	{
+		MQTTAsync_setMsgIdInUse(m, msgid, 1);
 		m->c->msgID = msgid;
+	}
 	if (locked)
 		MQTTAsync_unlock_mutex(mqttasync_mutex);
 	FUNC_EXIT_RC(msgid);
@@ -2680,8 +3016,7 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, int
 	}
 
 	/* Add subscribe request to operation queue */
-	sub = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(sub, '\0', sizeof(MQTTAsync_queuedCommand));
+	sub = MQTTAsync_allocCommand();
 	sub->client = m;
 	sub->command.token = msgid;
 	if (response)
@@ -2753,8 +3088,7 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 	}
 
 	/* Add unsubscribe request to operation queue */
-	unsub = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(unsub, '\0', sizeof(MQTTAsync_queuedCommand));
+	unsub = MQTTAsync_allocCommand();
 	unsub->client = m;
 	unsub->command.type = UNSUBSCRIBE;
 	unsub->command.token = msgid;
@@ -2788,24 +3122,8 @@ int MQTTAsync_unsubscribe(MQTTAsync handle, const char* topic, MQTTAsync_respons
 }
 
 
-static int MQTTAsync_countBufferedMessages(MQTTAsyncs* m)
-{
-	ListElement* current = NULL;
-	int count = 0;
-
-	while (ListNextElement(commands, &current))
-	{
-		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
-
-		if (cmd->client == m && cmd->command.type == PUBLISH)
-			count++;
-	}
-	return count;
-}
-
-
-int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen, void* payload,
-							 int qos, int retained, MQTTAsync_responseOptions* response)
+static int MQTTAsync_send1(MQTTAsync handle, const char* destinationName, int payloadlen, const void* payload,
+							 int qos, int retained, int flags, MQTTAsync_responseOptions* response)
 {
 	int rc = MQTTASYNC_SUCCESS;
 	MQTTAsyncs* m = handle;
@@ -2818,21 +3136,20 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 	else if (m->c->connected == 0 && (m->createOptions == NULL ||
 		m->createOptions->sendWhileDisconnected == 0 || m->shouldBeConnected == 0))
 		rc = MQTTASYNC_DISCONNECTED;
-	else if (!UTF8_validateString(destinationName))
+	else if ((flags & MQTTASYNC_STATIC_TOPIC) == 0 && !UTF8_validateString(destinationName))
 		rc = MQTTASYNC_BAD_UTF8_STRING;
 	else if (qos < 0 || qos > 2)
 		rc = MQTTASYNC_BAD_QOS;
+	else if (m->createOptions && (m->noBufferedMessages >= m->createOptions->maxBufferedMessages))
+		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
 	else if (qos > 0 && (msgid = MQTTAsync_assignMsgId(m)) == 0)
 		rc = MQTTASYNC_NO_MORE_MSGIDS;
-	else if (m->createOptions && (MQTTAsync_countBufferedMessages(m) >= m->createOptions->maxBufferedMessages))
-		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
 
 	if (rc != MQTTASYNC_SUCCESS)
 		goto exit;
 
 	/* Add publish request to operation queue */
-	pub = malloc(sizeof(MQTTAsync_queuedCommand));
-	memset(pub, '\0', sizeof(MQTTAsync_queuedCommand));
+	pub = MQTTAsync_allocCommand();
 	pub->client = m;
 	pub->command.type = PUBLISH;
 	pub->command.token = msgid;
@@ -2843,12 +3160,33 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 		pub->command.context = response->context;
 		response->token = pub->command.token;
 	}
-	pub->command.details.pub.destinationName = MQTTStrdup(destinationName);
+	if (flags & MQTTASYNC_STATIC_TOPIC)
+		pub->command.details.pub.destinationName = (char*)destinationName;
+	else
+	{
+		size_t topiclen = strlen(destinationName) + 1;
+
+		pub->command.details.pub.destinationName = MQTTAsync_allocBuffer(topiclen);
+		memcpy(pub->command.details.pub.destinationName, destinationName, topiclen);
+		flags |= MQTTASYNC_POOLED_TOPIC;
+	}
 	pub->command.details.pub.payloadlen = payloadlen;
-	pub->command.details.pub.payload = malloc(payloadlen);
-	memcpy(pub->command.details.pub.payload, payload, payloadlen);
+	if (flags & MQTTASYNC_STATIC_PAYLOAD)
+		pub->command.details.pub.payload = (void*)payload;
+	else if (flags & MQTTASYNC_TRANSFER_PAYLOAD)
+	{
+		pub->command.details.pub.payload = (void*)payload;
+		flags = (flags & ~MQTTASYNC_TRANSFER_PAYLOAD) | MQTTASYNC_POOLED_PAYLOAD;
+	}
+	else
+	{
+		pub->command.details.pub.payload = MQTTAsync_allocBuffer(payloadlen);
+		memcpy(pub->command.details.pub.payload, payload, payloadlen);
+		flags |= MQTTASYNC_POOLED_PAYLOAD;
+	}
 	pub->command.details.pub.qos = qos;
 	pub->command.details.pub.retained = retained;
+	pub->command.details.pub.flags = flags;
 	rc = MQTTAsync_addCommand(pub, sizeof(pub));
 
 exit:
@@ -2857,6 +3195,35 @@ exit:
 }
 
 
+int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen, void* payload,
+							 int qos, int retained, MQTTAsync_responseOptions* response)
+{
+	return MQTTAsync_send1(handle, destinationName, payloadlen, payload, qos, retained, 0, response);
+}
+
+
+int MQTTAsync_sendStatic(MQTTAsync handle, const char* destinationName, int payloadlen, const void* payload,
+							 int qos, int retained, int flags, MQTTAsync_responseOptions* response)
+{
+	flags &= (MQTTASYNC_STATIC_TOPIC | MQTTASYNC_STATIC_PAYLOAD | MQTTASYNC_TRANSFER_PAYLOAD);
+	return MQTTAsync_send1(handle, destinationName, payloadlen, payload, qos, retained, flags, response);
+}
+
+
+int MQTTAsync_checkTopic(const char* destinationName)
+{
+	int rc = MQTTASYNC_SUCCESS;
+
+	FUNC_ENTRY;
+	if (destinationName == NULL)
+		rc = MQTTASYNC_NULL_PARAMETER;
+	else if (!UTF8_validateString(destinationName))
+		rc = MQTTASYNC_BAD_UTF8_STRING;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 
 int MQTTAsync_sendMessage(MQTTAsync handle, const char* destinationName, const MQTTAsync_message* message,
 													 MQTTAsync_responseOptions* response)
@@ -2883,16 +3250,17 @@ exit:
 }
 
 
+static time_t lastRetry = 0L;
+
 static void MQTTAsync_retry(void)
 {
-	static time_t last = 0L;
 	time_t now;
 
 	FUNC_ENTRY;
 	time(&(now));
-	if (difftime(now, last) > retryLoopInterval)
+	if (difftime(now, lastRetry) > retryLoopInterval)
 	{
-		time(&(last));
+		time(&(lastRetry));
 		MQTTProtocol_keepalive(now);
 		MQTTProtocol_retry(now, 1, 0);
 	}
@@ -2902,6 +3270,59 @@ static void MQTTAsync_retry(void)
 }
 
 
+/**
+ * How long the receive thread can wait for socket activity before MQTTAsync_retry() has work to do.
+ * Without a wake fd this is the old fixed 1 second.  With one, it is the earliest keepalive deadline
+ * of the connected clients, rounded up a second as the deadlines only have second resolution.
+ * In-flight messages and messages refused by messageArrived keep the old 1 second cycle for their retries.
+ * Persistence syncs that are due are done here, and the timeout is cut short for the next one, as
+ * the records this thread persists don't wake the send thread.
+ * @return the timeout in milliseconds
+ */
+static long MQTTAsync_receiveTimeout(void)
+{
+	long timeout = 1000L;
+	long sync;
+#if defined(SOCKET_WAKE)
+	ListElement* current = NULL;
+	time_t now;
+	time_t deadline = 0L;
+
+	FUNC_ENTRY;
+	time(&(now));
+	while (ListNextElement(handles, &current))
+	{
+		Clients* client = ((MQTTAsyncs*)(current->content))->c;
+		time_t due;
+
+		if (client->messageQueue->count > 0 || (client->connected && client->outboundMsgs->count > 0))
+		{
+			deadline = now;
+			break;
+		}
+		if (!client->connected || client->keepAliveInterval <= 0)
+			continue;
+		due = ((client->net.lastSent < client->net.lastReceived) ? client->net.lastSent : client->net.lastReceived)
+				+ client->keepAliveInterval;
+		if (due < lastRetry + retryLoopInterval + 1)
+			due = lastRetry + retryLoopInterval + 1; /* MQTTAsync_retry() will not run the keepalive before this */
+		if (deadline == 0L || due < deadline)
+			deadline = due;
+	}
+	if (deadline == 0L)
+		timeout = MQTTASYNC_MAX_RECEIVE_WAIT;
+	else
+		timeout = (long)max(1, deadline - now + 1) * 1000L;
+	if (timeout > MQTTASYNC_MAX_RECEIVE_WAIT)
+		timeout = MQTTASYNC_MAX_RECEIVE_WAIT;
+	FUNC_EXIT;
+#endif
+	if ((sync = MQTTAsync_syncPersistence()) >= 0 && sync < timeout)
+		timeout = sync;
+	return timeout;
+}
+
+
 static int MQTTAsync_connecting(MQTTAsyncs* m)
 {
 	int rc = -1;
@@ -3021,8 +3442,10 @@ static MQTTPacket* MQTTAsync_cycle(int* sock, unsigned long timeout, int* rc)
 #endif
 		/* 0 from getReadySocket indicates no work to do, -1 == error, but can happen normally */
 		*sock = Socket_getReadySocket(0, &tp,socket_mutex);
+#if !defined(SOCKET_WAKE)
 		if (!tostop && *sock == 0 && (tp.tv_sec > 0L || tp.tv_usec > 0L))
 			MQTTAsync_sleep(100L);
+#endif
 #if defined(OPENSSL)
 	}
 #endif
@@ -3283,6 +3706,15 @@ exit:
 
 
 
+void MQTTAsync_setWriteBatching(int maxBytes, int maxCount, int maxDelay)
+{
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	Socket_setBatchLimits(maxBytes > 0 ? (size_t)maxBytes : 0, maxCount);
+	batch_delay = maxDelay > 0 ? maxDelay : 0L;
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+}
+
+
 void MQTTAsync_setTraceLevel(enum MQTTASYNC_TRACE_LEVELS level)
 {
 	Log_setTraceLevel((enum LOG_LEVELS)level);
@@ -566,11 +566,18 @@ DLLExport int MQTTAsync_reconnect(MQTTAsync handle);
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Like ::MQTTCLIENT_PERSISTENCE_DEFAULT, but
+ * with everything held in one append-only log file, so that persisting a
+ * message costs one write rather than a file create, and reads at startup
+ * don't need a directory scan.  Not available on Windows.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
  * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
  * should be set to the location of the persistence directory (if set
  * to NULL, the persistence directory used is the working directory).
+ * The same goes for ::MQTTCLIENT_PERSISTENCE_LOG, with the log file
+ * placed in that directory.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @return ::MQTTASYNC_SUCCESS if the client is successfully created, otherwise
@@ -1038,6 +1045,89 @@ DLLExport int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int
 																 MQTTAsync_responseOptions* response);
 
 
+/**
+  * Flag for MQTTAsync_sendStatic(): the topic string is used in place rather
+  * than copied, and is not checked for valid UTF-8 (see MQTTAsync_checkTopic()).
+  * It must stay valid and unchanged for the life of the client.
+  */
+#define MQTTASYNC_STATIC_TOPIC 1
+/**
+  * Flag for MQTTAsync_sendStatic(): the payload buffer is used in place rather
+  * than copied. It must stay valid and unchanged until the client has finished
+  * with the message, which in practice means a buffer that is never rewritten.
+  */
+#define MQTTASYNC_STATIC_PAYLOAD 2
+/**
+  * Flag for MQTTAsync_sendStatic(): the payload buffer came from
+  * MQTTAsync_mallocPayload() and the client takes ownership of it instead of
+  * copying it, giving it back to its pool once the message is done with.
+  * Ownership only passes if ::MQTTASYNC_SUCCESS is returned.
+  */
+#define MQTTASYNC_TRANSFER_PAYLOAD 4
+
+/**
+  * This function behaves like MQTTAsync_send(), but lets the caller hand over a
+  * topic and/or payload that the client uses in place instead of copying, so a
+  * publish from a pre-built topic table does no validation or copying of its own.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param destinationName The topic associated with this message.
+  * @param payloadlen The length of the payload in bytes.
+  * @param payload A pointer to the byte array payload of the message.
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param flags A combination of ::MQTTASYNC_STATIC_TOPIC and either
+  * ::MQTTASYNC_STATIC_PAYLOAD or ::MQTTASYNC_TRANSFER_PAYLOAD. With no flags
+  * set this is MQTTAsync_send().
+  * @param response A pointer to an ::MQTTAsync_responseOptions structure. Used to set callback functions.
+  * This is optional and can be set to NULL.
+  * @return ::MQTTASYNC_SUCCESS if the message is accepted for publication.
+  * An error code is returned if there was a problem accepting the message.
+  */
+DLLExport int MQTTAsync_sendStatic(MQTTAsync handle, const char* destinationName, int payloadlen, const void* payload, int qos, int retained,
+																 int flags, MQTTAsync_responseOptions* response);
+
+/**
+  * This function checks a topic once so it can later be published with
+  * ::MQTTASYNC_STATIC_TOPIC.
+  * @param destinationName The topic to check.
+  * @return ::MQTTASYNC_SUCCESS if the topic can be published,
+  * ::MQTTASYNC_BAD_UTF8_STRING or ::MQTTASYNC_NULL_PARAMETER otherwise.
+  */
+DLLExport int MQTTAsync_checkTopic(const char* destinationName);
+
+/**
+  * Allocates a payload buffer from the client's payload pool, to be filled in
+  * and published with ::MQTTASYNC_TRANSFER_PAYLOAD.
+  * @param size The payload length that will be passed to MQTTAsync_sendStatic().
+  * @return The buffer. If the publish is not accepted it is still the
+  * caller's, to be released with MQTTAsync_free().
+  */
+DLLExport void* MQTTAsync_mallocPayload(size_t size);
+
+/**
+  * Counters for the pools that queued commands and publish payloads are
+  * recycled through. A hit is an allocation served from a pool, a miss one
+  * that went to the heap.
+  */
+typedef struct
+{
+	unsigned long commandHits;
+	unsigned long commandMisses;
+	unsigned long bufferHits;
+	unsigned long bufferMisses;
+	/** Blocks currently held on the free lists */
+	int commandsFree;
+	int buffersFree;
+} MQTTAsync_poolStats;
+
+/**
+  * Reads the allocation pool counters, which are shared by all clients.
+  * @param stats Set to the current counters.
+  */
+DLLExport void MQTTAsync_getPoolStats(MQTTAsync_poolStats* stats);
+
+
 /**
   * This function attempts to publish a message to a given topic (see also
   * MQTTAsync_publish()). An ::MQTTAsync_token is issued when
@@ -1134,6 +1224,24 @@ DLLExport void MQTTAsync_destroy(MQTTAsync* handle);
 
 
 
+/**
+  * This function lets the client gather publishes queued back to back into
+  * a single socket write, instead of one write per publish.  Publishes are
+  * copied into the batch and reported as sent when they join it, and the
+  * batch is written once it holds maxBytes or maxCount packets, or once the
+  * command queue is empty and maxDelay has passed since the first one.
+  * Batching applies to all clients, and is off until this is called.  It
+  * is not used for SSL connections.
+  * @param maxBytes the batch is written once it holds at least this many
+  * bytes.  Bigger publishes are written directly when nothing is batched.
+  * @param maxCount the batch is written once it holds this many packets.
+  * Less than 2 turns batching off.
+  * @param maxDelay how long in milliseconds a batch may wait for more
+  * publishes once the command queue is empty.  0 writes it straight away.
+  */
+DLLExport void MQTTAsync_setWriteBatching(int maxBytes, int maxCount, int maxDelay);
+
+
 enum MQTTASYNC_TRACE_LEVELS
 {
 	MQTTASYNC_TRACE_MAXIMUM = 1,
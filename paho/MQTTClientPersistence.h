@@ -77,6 +77,13 @@
   * persistence mechanism (see MQTTClient_create()).
   */
 #define MQTTCLIENT_PERSISTENCE_USER 2
+/**
+  * This <i>persistence_type</i> value specifies a persistence mechanism that
+  * keeps everything for a client in one append-only log file, beneath the
+  * directory given as the persistence context (see MQTTClient_create()).
+  * It is not available on Windows.
+  */
+#define MQTTCLIENT_PERSISTENCE_LOG 3
 
 /** 
   * Application-specific persistence functions must return this error code if 
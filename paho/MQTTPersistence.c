@@ -27,6 +27,7 @@
 
 #include "MQTTPersistence.h"
 #include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
 #include "MQTTProtocolClient.h"
 #include "Heap.h"
 
@@ -79,6 +80,29 @@ int MQTTPersistence_create(MQTTClient_persistence** persistence, int type, void*
 			else
 				rc = MQTTCLIENT_PERSISTENCE_ERROR;
 			break;
+#if !defined(WIN32) && !defined(WIN64)
+		case MQTTCLIENT_PERSISTENCE_LOG :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				const char* dir = (pcontext != NULL) ? pcontext : ".";
+
+				per->context = malloc(strlen(dir) + 1);
+				strcpy(per->context, dir);
+				/* append-only log file functions */
+				per->popen        = logopen;
+				per->pclose       = logclose;
+				per->pput         = logput;
+				per->pget         = logget;
+				per->premove      = logremove;
+				per->pkeys        = logkeys;
+				per->pclear       = logclear;
+				per->pcontainskey = logcontainskey;
+			}
+			else
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			break;
+#endif
 		case MQTTCLIENT_PERSISTENCE_USER :
 			per = (MQTTClient_persistence *)pcontext;
 			if ( per == NULL || (per != NULL && (per->context == NULL || per->pclear == NULL ||
@@ -139,6 +163,13 @@ int MQTTPersistence_close(Clients *c)
 #if !defined(NO_PERSISTENCE)
 		if ( c->persistence->popen == pstopen )
 			free(c->persistence);
+#if !defined(WIN32) && !defined(WIN64)
+		else if ( c->persistence->popen == logopen )
+		{
+			free(c->persistence->context);
+			free(c->persistence);
+		}
+#endif
 #endif
 		c->persistence = NULL;
 	}
@@ -165,6 +196,26 @@ int MQTTPersistence_clear(Clients *c)
 }
 
 
+/**
+ * Syncs the persistent store if it batches syncs and the oldest unsynced data is due.
+ * @param client the client as ::Clients.
+ * @return the milliseconds until it has to be called again, -1 if nothing is waiting to be synced.
+ */
+long MQTTPersistence_sync(Clients *c)
+{
+	long rc = -1L;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE) && !defined(WIN32) && !defined(WIN64)
+	if (c->persistence != NULL && c->persistence->popen == logopen)
+		rc = logsyncdue(c->phandle);
+#endif
+
+	FUNC_EXIT;
+	return rc;
+}
+
+
 /**
  * Restores the persisted records to the outbound and inbound message queues of the
  * client.
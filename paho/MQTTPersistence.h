@@ -38,6 +38,7 @@ int MQTTPersistence_create(MQTTClient_persistence** per, int type, void* pcontex
 int MQTTPersistence_initialize(Clients* c, const char* serverURI);
 int MQTTPersistence_close(Clients* c);
 int MQTTPersistence_clear(Clients* c);
+long MQTTPersistence_sync(Clients* c);
 int MQTTPersistence_restore(Clients* c);
 void* MQTTPersistence_restorePacket(char* buffer, size_t buflen);
 void MQTTPersistence_insertInOrder(List* list, void* content, size_t size);
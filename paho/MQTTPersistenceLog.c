@@ -0,0 +1,717 @@
+/*******************************************************************************
+ * Copyright (c) 2026 wink-relay-manager contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    wink-relay-manager contributors - initial API and implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief An append-only log file persistence implementation.
+ *
+ * All the data for a client ID and connection key is kept in one file beneath the directory
+ * specified when the MQTT client is created.  Puts and removes are appended to the file as
+ * records, and an index of the live records is held in memory, built by reading the file
+ * once when the persistence is opened.  Records are synced in batches (see ::LOG_SYNC_RECORDS
+ * and ::LOG_SYNC_INTERVAL) rather than one by one, and the file is rewritten with just the
+ * live records once dead ones outweigh them (see ::LOG_COMPACT_MIN).
+ *
+ * A record torn by a crash fails its check and is cut off, with everything after it, when the
+ * log is next opened.
+ */
+
+#if !defined(NO_PERSISTENCE) && !defined(WIN32) && !defined(WIN64)
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+#define LOG_RECORD_PUT 0x4C500001
+#define LOG_RECORD_REMOVE 0x4C500002
+#define LOG_MAX_KEY 256
+
+/**
+ * Header of each record in the log, followed by the key, including its terminating null,
+ * and the data
+ */
+typedef struct
+{
+	unsigned int type; /**< LOG_RECORD_PUT or LOG_RECORD_REMOVE */
+	unsigned int keylen;
+	unsigned int datalen;
+	unsigned int check; /**< of the other header fields, the key and the data */
+} log_record;
+
+/**
+ * A live key in the log
+ */
+typedef struct
+{
+	char* key;
+	off_t offset; /**< where the data is in the file */
+	int len;
+} log_entry;
+
+typedef struct
+{
+	char* path;
+	int fd;
+	Tree* entries; /**< the log_entry of each live key, by key */
+	off_t size; /**< bytes in the file */
+	off_t live; /**< bytes of the file taken by the records in entries */
+	int unsynced; /**< records appended since the last sync */
+	long long unsynced_since; /**< when the first of them was appended, see lognow() */
+} log_store;
+
+
+static unsigned int logcheck(unsigned int check, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+
+	/* FNV-1a */
+	while (len-- > 0)
+		check = (check ^ *p++) * 16777619U;
+	return check;
+}
+
+
+static unsigned int logheadercheck(log_record* rec)
+{
+	return logcheck(2166136261U, rec, offsetof(log_record, check));
+}
+
+
+static off_t logrecordsize(int keylen, int datalen)
+{
+	return (off_t)sizeof(log_record) + keylen + datalen;
+}
+
+
+/**
+ * Orders the index by key.
+ * @param content whether b is a log_entry rather than a key
+ */
+static int logkeycompare(void* a, void* b, int content)
+{
+	return strcmp(((log_entry*)a)->key, content ? ((log_entry*)b)->key : (char*)b);
+}
+
+
+static log_entry* logfind(log_store* store, char* key)
+{
+	Node* node = TreeFind(store->entries, key);
+
+	return node ? (log_entry*)(node->content) : NULL;
+}
+
+
+static void logdrop(log_store* store, log_entry* entry)
+{
+	store->live -= logrecordsize((int)strlen(entry->key) + 1, entry->len);
+	TreeRemove(store->entries, entry);
+	free(entry->key);
+	free(entry);
+}
+
+
+static void logfreeentries(log_store* store)
+{
+	Node* node = NULL;
+
+	while ((node = TreeNextElement(store->entries, NULL)) != NULL)
+	{
+		log_entry* entry = TreeRemoveNodeIndex(store->entries, node, 0);
+
+		free(entry->key);
+		free(entry);
+	}
+	store->live = 0;
+}
+
+
+/**
+ * Record a put in the index.
+ * @param offset where the data of the record is in the file
+ */
+static void logapplyput(log_store* store, char* key, off_t offset, int len)
+{
+	log_entry* entry = logfind(store, key);
+
+	if (entry)
+		store->live -= logrecordsize((int)strlen(key) + 1, entry->len);
+	else
+	{
+		entry = malloc(sizeof(log_entry));
+		entry->key = malloc(strlen(key) + 1);
+		strcpy(entry->key, key);
+		TreeAdd(store->entries, entry, sizeof(log_entry));
+	}
+	entry->offset = offset;
+	entry->len = len;
+	store->live += logrecordsize((int)strlen(key) + 1, len);
+}
+
+
+/**
+ * Write one record to a file in a single system call.
+ * @return the number of bytes written, or -1 on error
+ */
+static ssize_t logwrite(int fd, unsigned int type, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	log_record rec;
+	struct iovec iov[8];
+	struct iovec* iovs = iov;
+	ssize_t total, rc;
+	int i;
+
+	rec.type = type;
+	rec.keylen = (unsigned int)strlen(key) + 1;
+	rec.datalen = 0;
+	for (i = 0; i < bufcount; ++i)
+		rec.datalen += buflens[i];
+	rec.check = logcheck(logheadercheck(&rec), key, rec.keylen);
+	for (i = 0; i < bufcount; ++i)
+		rec.check = logcheck(rec.check, buffers[i], buflens[i]);
+
+	if (bufcount + 2 > (int)(sizeof(iov) / sizeof(iov[0])))
+		iovs = malloc(sizeof(struct iovec) * (bufcount + 2));
+	iovs[0].iov_base = &rec;
+	iovs[0].iov_len = sizeof(rec);
+	iovs[1].iov_base = key;
+	iovs[1].iov_len = rec.keylen;
+	for (i = 0; i < bufcount; ++i)
+	{
+		iovs[i + 2].iov_base = buffers[i];
+		iovs[i + 2].iov_len = buflens[i];
+	}
+	total = (ssize_t)logrecordsize(rec.keylen, rec.datalen);
+	do
+		rc = writev(fd, iovs, bufcount + 2);
+	while (rc == -1 && errno == EINTR);
+	if (iovs != iov)
+		free(iovs);
+	return (rc == total) ? rc : -1;
+}
+
+
+/**
+ * Read the log from the start to build the index, cutting off anything after the
+ * first record that is incomplete or fails its check.
+ */
+static int logscan(log_store* store)
+{
+	int rc = 0;
+	off_t offset = 0;
+	struct stat st;
+	char* buf = NULL;
+	size_t bufsize = 0;
+
+	FUNC_ENTRY;
+	if (fstat(store->fd, &st) != 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	while (offset + (off_t)sizeof(log_record) <= st.st_size)
+	{
+		log_record rec;
+		size_t len;
+
+		if (pread(store->fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+				(rec.type != LOG_RECORD_PUT && rec.type != LOG_RECORD_REMOVE) ||
+				rec.keylen < 2 || rec.keylen > LOG_MAX_KEY ||
+				logrecordsize(rec.keylen, rec.datalen) > st.st_size - offset)
+			break;
+		len = rec.keylen + rec.datalen;
+		if (len > bufsize)
+		{
+			if (buf)
+				free(buf);
+			buf = malloc(len);
+			bufsize = len;
+		}
+		if (pread(store->fd, buf, len, offset + sizeof(rec)) != (ssize_t)len ||
+				logcheck(logheadercheck(&rec), buf, len) != rec.check || buf[rec.keylen - 1] != '\0')
+			break;
+		if (rec.type == LOG_RECORD_PUT)
+			logapplyput(store, buf, offset + sizeof(rec) + rec.keylen, rec.datalen);
+		else
+		{
+			log_entry* entry = logfind(store, buf);
+
+			if (entry)
+				logdrop(store, entry);
+		}
+		offset += logrecordsize(rec.keylen, rec.datalen);
+	}
+	if (offset < st.st_size)
+	{
+		Log(LOG_ERROR, -1, "Truncating persistence log %s from %ld to %ld bytes",
+				store->path, (long)st.st_size, (long)offset);
+		if (ftruncate(store->fd, offset) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	store->size = offset;
+	if (buf)
+		free(buf);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Milliseconds on the monotonic clock
+ */
+static long long lognow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+static void logsync(log_store* store, int force)
+{
+	if (store->unsynced == 0)
+		return;
+	if (force || store->unsynced >= LOG_SYNC_RECORDS || lognow() - store->unsynced_since >= LOG_SYNC_INTERVAL)
+	{
+		if (fsync(store->fd) != 0)
+			Log(LOG_ERROR, -1, "fsync of persistence log %s failed, errno %d", store->path, errno);
+		store->unsynced = 0;
+	}
+}
+
+
+/**
+ * Sync the directory holding the log, so that a rename of the log survives a crash.
+ */
+static int logsyncdir(log_store* store)
+{
+	int rc = 0;
+	char* dir = malloc(strlen(store->path) + 1);
+	char* slash;
+	int fd;
+
+	strcpy(dir, store->path);
+	if ((slash = strrchr(dir, '/')) != NULL)
+		*(slash == dir ? slash + 1 : slash) = '\0';
+	else
+		strcpy(dir, ".");
+	if ((fd = open(dir, O_RDONLY)) == -1 || fsync(fd) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	if (fd != -1)
+		close(fd);
+	free(dir);
+	return rc;
+}
+
+
+/**
+ * Rewrite the log with just the live records, once the dead ones outweigh them.
+ * Compaction is best effort: if it fails the log is left as it was and is still used.
+ * @return 0, or #MQTTCLIENT_PERSISTENCE_ERROR if the log could not be reopened after it was replaced
+ */
+static int logcompact(log_store* store)
+{
+	int rc = 0;
+	off_t dead = store->size - store->live;
+	char* tmppath = NULL;
+	off_t* offsets = NULL;
+	int tmpfd = -1;
+	off_t size = 0;
+	Node* node = NULL;
+	int i = 0;
+
+	FUNC_ENTRY;
+	if (dead < LOG_COMPACT_MIN || dead <= store->live)
+		goto exit;
+
+	if (store->entries->count == 0)
+	{ /* nothing live, so just empty the file */
+		if (ftruncate(store->fd, 0) != 0)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else
+		{
+			store->size = 0;
+			store->unsynced = 1;
+			logsync(store, 1);
+		}
+		goto exit;
+	}
+
+	tmppath = malloc(strlen(store->path) + 5);
+	sprintf(tmppath, "%s.tmp", store->path);
+	offsets = malloc(sizeof(off_t) * store->entries->count);
+	if ((tmpfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	while ((node = TreeNextElement(store->entries, node)) != NULL)
+	{
+		log_entry* entry = (log_entry*)(node->content);
+		char* data = malloc(entry->len ? entry->len : 1);
+		ssize_t written = -1;
+
+		if (pread(store->fd, data, entry->len, entry->offset) == entry->len)
+			written = logwrite(tmpfd, LOG_RECORD_PUT, entry->key, 1, &data, &entry->len);
+		free(data);
+		if (written < 0)
+		{
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			goto exit;
+		}
+		offsets[i++] = size + sizeof(log_record) + strlen(entry->key) + 1;
+		size += written;
+	}
+	if (fsync(tmpfd) != 0 || rename(tmppath, store->path) != 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if (logsyncdir(store) != 0)
+		Log(LOG_ERROR, -1, "fsync of the directory of persistence log %s failed, errno %d", store->path, errno);
+	close(store->fd);
+	store->fd = open(store->path, O_RDWR | O_APPEND);
+	node = NULL;
+	i = 0;
+	while ((node = TreeNextElement(store->entries, node)) != NULL)
+		((log_entry*)(node->content))->offset = offsets[i++];
+	Log(TRACE_MIN, -1, "Compacted persistence log %s from %ld to %ld bytes", store->path, (long)store->size, (long)size);
+	store->size = size;
+	store->unsynced = 0;
+	if (store->fd == -1)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+exit:
+	if (rc != 0)
+		Log(LOG_ERROR, -1, "Compaction of persistence log %s failed, errno %d", store->path, errno);
+	if (tmpfd != -1)
+	{
+		close(tmpfd);
+		if (rc != 0)
+			unlink(tmppath);
+	}
+	if (rc != 0 && store->fd != -1)
+		rc = 0; /* carry on with the uncompacted log */
+	if (tmppath)
+		free(tmppath);
+	if (offsets)
+		free(offsets);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Open the log file for the client: context/clientID-serverURI.log, and read its index.
+ *  See ::Persistence_open
+ */
+int logopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	int rc = 0;
+	char* dataDir = context;
+	char* ptraux;
+	log_store* store = NULL;
+
+	FUNC_ENTRY;
+	if ((rc = pstmkdir(dataDir)) != 0)
+		goto exit;
+
+	store = malloc(sizeof(log_store));
+	memset(store, '\0', sizeof(log_store));
+	/* consider '/' + '-' + '\0' */
+	store->path = malloc(strlen(dataDir) + strlen(clientID) + strlen(serverURI) + strlen(LOG_FILENAME_EXTENSION) + 3);
+	sprintf(store->path, "%s/%s-", dataDir, clientID);
+	ptraux = store->path + strlen(store->path);
+	strcpy(ptraux, serverURI);
+	while ((ptraux = strpbrk(ptraux, ":/")) != NULL)
+		*ptraux = '-';
+	strcat(store->path, LOG_FILENAME_EXTENSION);
+	store->entries = TreeInitialize(logkeycompare);
+
+	if ((store->fd = open(store->path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) == -1 ||
+			(rc = logscan(store)) != 0 || (rc = logcompact(store)) != 0)
+	{
+		if (store->fd != -1)
+			close(store->fd);
+		logfreeentries(store);
+		TreeFree(store->entries);
+		free(store->path);
+		free(store);
+		store = NULL;
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	*handle = store;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Sync and close the log file, removing it if it holds nothing.
+ *  See ::Persistence_close
+ */
+int logclose(void* handle)
+{
+	int rc = 0;
+	log_store* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	logsync(store, 1);
+	close(store->fd);
+	if (store->entries->count == 0 && unlink(store->path) != 0 && errno != ENOENT)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	logfreeentries(store);
+	TreeFree(store->entries);
+	free(store->path);
+	free(store);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a wire message to the log.
+ *  See ::Persistence_put
+ */
+int logput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = 0;
+	log_store* store = handle;
+	ssize_t written;
+	int i, len = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL || strlen(key) + 1 > LOG_MAX_KEY)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if ((written = logwrite(store->fd, LOG_RECORD_PUT, key, bufcount, buffers, buflens)) < 0)
+	{
+		/* don't leave a partial record for the next one to be appended to */
+		if (ftruncate(store->fd, store->size) != 0)
+			Log(LOG_ERROR, -1, "Failed to truncate persistence log %s", store->path);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < bufcount; ++i)
+		len += buflens[i];
+	logapplyput(store, key, store->size + sizeof(log_record) + strlen(key) + 1, len);
+	store->size += written;
+	if (store->unsynced++ == 0)
+		store->unsynced_since = lognow();
+	logsync(store, 0);
+	rc = logcompact(store);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a wire message from the log.
+ *  See ::Persistence_get
+ */
+int logget(void* handle, char* key, char** buffer, int* buflen)
+{
+	int rc = 0;
+	log_store* store = handle;
+	log_entry* entry;
+	char* buf;
+
+	FUNC_ENTRY;
+	if (store == NULL || (entry = logfind(store, key)) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	buf = malloc(entry->len ? entry->len : 1);
+	if (pread(store->fd, buf, entry->len, entry->offset) != entry->len)
+	{
+		free(buf);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	*buffer = buf; /* the caller must free buf */
+	*buflen = entry->len;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append the removal of a wire message to the log.
+ *  See ::Persistence_remove
+ */
+int logremove(void* handle, char* key)
+{
+	int rc = 0;
+	log_store* store = handle;
+	log_entry* entry;
+	ssize_t written;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	if ((entry = logfind(store, key)) == NULL)
+		goto exit;
+
+	if ((written = logwrite(store->fd, LOG_RECORD_REMOVE, key, 0, NULL, NULL)) < 0)
+	{
+		if (ftruncate(store->fd, store->size) != 0)
+			Log(LOG_ERROR, -1, "Failed to truncate persistence log %s", store->path);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	logdrop(store, entry);
+	store->size += written;
+	if (store->unsynced++ == 0)
+		store->unsynced_since = lognow();
+	logsync(store, 0);
+	rc = logcompact(store);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys of the live records in the log.
+ *  See ::Persistence_keys
+ */
+int logkeys(void* handle, char*** keys, int* nkeys)
+{
+	int rc = 0;
+	log_store* store = handle;
+	Node* node = NULL;
+	int i = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	*keys = NULL;
+	*nkeys = store->entries->count;
+	if (*nkeys > 0)
+	{
+		*keys = malloc(sizeof(char*) * (*nkeys));
+		while ((node = TreeNextElement(store->entries, node)) != NULL)
+		{
+			char* key = ((log_entry*)(node->content))->key;
+
+			(*keys)[i] = malloc(strlen(key) + 1);
+			strcpy((*keys)[i++], key);
+		}
+	}
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Empties the log.
+ *  See ::Persistence_clear
+ */
+int logclear(void* handle)
+{
+	int rc = 0;
+	log_store* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL || ftruncate(store->fd, 0) != 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	logfreeentries(store);
+	store->size = 0;
+	store->unsynced = 1;
+	logsync(store, 1);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a wire message is live in the log.
+ *  See ::Persistence_containskey
+ */
+int logcontainskey(void* handle, char* key)
+{
+	int rc = 0;
+	log_store* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL || logfind(store, key) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Sync the log if its oldest unsynced record has waited ::LOG_SYNC_INTERVAL.  Puts and removes
+ * only check this when they append, so the client calls it while idle to keep the bound.
+ * @return the milliseconds until the log is next due a sync, -1 if nothing is waiting for one
+ */
+long logsyncdue(void* handle)
+{
+	log_store* store = handle;
+
+	if (store == NULL)
+		return -1L;
+	logsync(store, 0);
+	if (store->unsynced == 0)
+		return -1L;
+	return (long)(store->unsynced_since + LOG_SYNC_INTERVAL - lognow());
+}
+
+#endif /* !defined(NO_PERSISTENCE) && !defined(WIN32) && !defined(WIN64) */
@@ -0,0 +1,36 @@
+/*******************************************************************************
+ * Copyright (c) 2026 wink-relay-manager contributors
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    wink-relay-manager contributors - initial API and implementation
+ *******************************************************************************/
+
+/** Extension of the log file */
+#define LOG_FILENAME_EXTENSION ".log"
+/** Sync the log after this many records have been appended... */
+#define LOG_SYNC_RECORDS 16
+/** ...or when the oldest unsynced record is this many milliseconds old */
+#define LOG_SYNC_INTERVAL 1000
+/** Don't compact the log until it holds at least this many bytes of dead records */
+#define LOG_COMPACT_MIN 65536
+
+/* prototypes of the functions for the append-only log file persistence */
+int logopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int logclose(void* handle);
+int logput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int logget(void* handle, char* key, char** buffer, int* buflen);
+int logremove(void* handle, char* key);
+int logkeys(void* handle, char*** keys, int* nkeys);
+int logclear(void* handle);
+int logcontainskey(void* handle, char* key);
+
+long logsyncdue(void* handle);
@@ -46,13 +46,23 @@
 int Socket_setnonblocking(int sock);
 int Socket_error(char* aString, int sock);
 int Socket_addSocket(int newSd);
+#if !defined(USE_EPOLL)
 int isReady(int socket, fd_set* read_set, fd_set* write_set);
+int Socket_continueWrites(fd_set* pwset);
+#endif
 int Socket_writev(int socket, iobuf* iovecs, int count, unsigned long* bytes);
 int Socket_close_only(int socket);
 int Socket_continueWrite(int socket);
-int Socket_continueWrites(fd_set* pwset);
 char* Socket_getaddrname(struct sockaddr* sa, int sock);
 int Socket_abortWrite(int socket);
+#if defined(USE_EPOLL)
+static int Socket_epollUpdate(int socket, int events);
+static void Socket_continuePendingWrite(int socket);
+#endif
+#if defined(SOCKET_WAKE)
+static void Socket_drainWake(void);
+#endif
+static int Socket_recv(int socket, char* dest, size_t len);
 
 #if defined(WIN32) || defined(WIN64)
 #define iov_len len
@@ -63,7 +73,24 @@ int Socket_abortWrite(int socket);
  * Structure to hold all socket data for the module
  */
 Sockets s;
+#if !defined(USE_EPOLL)
 static fd_set wset;
+#endif
+
+/**
+ * Packets for one socket gathered by Socket_batchWrites, to go out in a single write
+ */
+static struct
+{
+	int socket; /**< socket the batched packets are for */
+	int active; /**< whether writes to socket are currently being batched */
+	int count; /**< number of packets in buf */
+	size_t len; /**< bytes used in buf */
+	size_t size; /**< bytes allocated for buf */
+	char* buf;
+	size_t max_bytes; /**< flush once this many bytes are batched */
+	int max_count; /**< flush once this many packets are batched, batching is off if < 2 */
+} batch;
 
 /**
  * Set a socket non-blocking, OS independently
@@ -141,7 +168,37 @@ void Socket_outInitialize(void)
 	FD_ZERO(&(s.rset));														/* Initialize the descriptor set */
 	FD_ZERO(&(s.pending_wset));
 	s.maxfdp1 = 0;
+#if defined(SOCKET_WAKE)
+	if (pipe(s.wakefds) == SOCKET_ERROR)
+	{
+		Socket_error("pipe", 0);
+		s.wakefds[0] = s.wakefds[1] = SOCKET_ERROR;
+	}
+	else
+	{
+		Socket_setnonblocking(s.wakefds[0]);
+		Socket_setnonblocking(s.wakefds[1]);
+		fcntl(s.wakefds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(s.wakefds[1], F_SETFD, FD_CLOEXEC);
+#if !defined(USE_EPOLL)
+		FD_SET(s.wakefds[0], &(s.rset));
+		s.maxfdp1 = s.wakefds[0] + 1;
+#endif
+	}
+#endif
 	memcpy((void*)&(s.rset_saved), (void*)&(s.rset), sizeof(s.rset_saved));
+#if defined(USE_EPOLL)
+	/* epoll_create1 is not available at our minimum API level */
+	if ((s.epfd = epoll_create(SOCKET_MAX_EVENTS)) == SOCKET_ERROR)
+		Socket_error("epoll_create", 0);
+	else
+		fcntl(s.epfd, F_SETFD, FD_CLOEXEC);
+	s.nevents = s.cur_event = 0;
+#if defined(SOCKET_WAKE)
+	if (s.wakefds[0] != SOCKET_ERROR)
+		Socket_epollUpdate(s.wakefds[0], EPOLLIN);
+#endif
+#endif
 	FUNC_EXIT;
 }
 
@@ -155,6 +212,24 @@ void Socket_outTerminate(void)
 	ListFree(s.connect_pending);
 	ListFree(s.write_pending);
 	ListFree(s.clientsds);
+#if defined(USE_EPOLL)
+	if (s.epfd != SOCKET_ERROR)
+		close(s.epfd);
+#endif
+#if defined(SOCKET_WAKE)
+	if (s.wakefds[0] != SOCKET_ERROR)
+	{
+		close(s.wakefds[0]);
+		close(s.wakefds[1]);
+		s.wakefds[0] = s.wakefds[1] = SOCKET_ERROR;
+	}
+#endif
+	if (batch.buf)
+	{
+		free(batch.buf);
+		batch.buf = NULL;
+	}
+	batch.size = batch.len = batch.count = batch.active = 0;
 	SocketBuffer_terminate();
 #if defined(WIN32) || defined(WIN64)
 	WSACleanup();
@@ -174,18 +249,29 @@ int Socket_addSocket(int newSd)
 	FUNC_ENTRY;
 	if (ListFindItem(s.clientsds, &newSd, intcompare) == NULL) /* make sure we don't add the same socket twice */
 	{
+#if defined(USE_EPOLL)
+		if (Socket_epollUpdate(newSd, EPOLLIN) == SOCKET_ERROR)
+		{
+			Log(LOG_ERROR, -1, "addSocket: epoll_ctl");
+			rc = SOCKET_ERROR;
+		}
+#else
 		if (s.clientsds->count >= FD_SETSIZE)
 		{
 			Log(LOG_ERROR, -1, "addSocket: exceeded FD_SETSIZE %d", FD_SETSIZE);
 			rc = SOCKET_ERROR;
 		}
+#endif
 		else
 		{
 			int* pnewSd = (int*)malloc(sizeof(newSd));
 			*pnewSd = newSd;
 			ListAppend(s.clientsds, pnewSd, sizeof(newSd));
+#if !defined(USE_EPOLL)
 			FD_SET(newSd, &(s.rset_saved));
 			s.maxfdp1 = max(s.maxfdp1, newSd + 1);
+			Socket_wake(); /* a select already in progress does not know about the new socket */
+#endif
 			rc = Socket_setnonblocking(newSd);
 			if (rc == SOCKET_ERROR)
 				Log(LOG_ERROR, -1, "addSocket: setnonblocking");
@@ -199,6 +285,7 @@ int Socket_addSocket(int newSd)
 }
 
 
+#if !defined(USE_EPOLL)
 /**
  * Don't accept work from a client unless it is accepting work back, i.e. its socket is writeable
  * this seems like a reasonable form of flow control, and practically, seems to work.
@@ -219,8 +306,131 @@ int isReady(int socket, fd_set* read_set, fd_set* write_set)
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
+#endif
 
 
+#if defined(USE_EPOLL)
+/**
+ * Register a socket with the epoll instance, or change the events it is registered for
+ * @param socket the socket
+ * @param events the epoll events of interest
+ * @return completion code
+ */
+static int Socket_epollUpdate(int socket, int events)
+{
+	struct epoll_event event;
+	int rc;
+
+	memset(&event, '\0', sizeof(event));
+	event.events = events;
+	event.data.fd = socket;
+	if ((rc = epoll_ctl(s.epfd, EPOLL_CTL_MOD, socket, &event)) == SOCKET_ERROR && errno == ENOENT)
+		rc = epoll_ctl(s.epfd, EPOLL_CTL_ADD, socket, &event);
+	if (rc == SOCKET_ERROR)
+		Socket_error("epoll_ctl", socket);
+	return rc;
+}
+
+
+/**
+ * The epoll equivalent of isReady().  epoll only reports writeability for sockets with a
+ * pending connect or write, so for the rest no pending output stands in for a writeable socket.
+ * @param event an entry from the last epoll_wait
+ * @return the socket if it is ready to go, otherwise 0
+ */
+static int Socket_epollReady(struct epoll_event* event)
+{
+	int socket = event->data.fd;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (socket == SOCKET_ERROR) /* closed since epoll_wait returned */
+		goto exit;
+#if defined(SOCKET_WAKE)
+	if (socket == s.wakefds[0])
+	{
+		Socket_drainWake();
+		goto exit;
+	}
+#endif
+	if ((event->events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && ListFindItem(s.connect_pending, &socket, intcompare))
+	{
+		ListRemoveItem(s.connect_pending, &socket, intcompare);
+		rc = socket;
+	}
+	else if ((event->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && Socket_noPendingWrites(socket))
+		rc = socket;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Returns the next socket ready for communications as indicated by epoll
+ *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
+ *  be used for the wait
+ *  @param tp the timeout to be used for the wait, unless overridden
+ *  @return the socket next ready, or 0 if none is ready
+ */
+int Socket_getReadySocket(int more_work, struct timeval *tp, mutex_type mutex)
+{
+	int rc = 0;
+	int timeout = 1000; /* 1 second */
+	int i;
+
+	FUNC_ENTRY;
+	Thread_lock_mutex(mutex);
+#if !defined(SOCKET_WAKE)
+	if (s.clientsds->count == 0)
+		goto exit;
+#endif
+	if ((rc = SocketBuffer_getReadAheadSocket(Socket_noPendingWrites)) != 0)
+		goto exit;
+
+	if (more_work)
+		timeout = 0;
+	else if (tp)
+		timeout = (int)(tp->tv_sec * 1000 + (tp->tv_usec + 999) / 1000);
+
+	/* hand out what is left from the previous wait before waiting again */
+	while (s.cur_event < s.nevents)
+	{
+		if ((rc = Socket_epollReady(&(s.events[s.cur_event++]))) != 0)
+			goto exit;
+	}
+
+	s.nevents = s.cur_event = 0;
+	/* Prevent performance issue by unlocking the socket_mutex while waiting for a ready socket. */
+	Thread_unlock_mutex(mutex);
+	rc = epoll_wait(s.epfd, s.events, SOCKET_MAX_EVENTS, timeout);
+	Thread_lock_mutex(mutex);
+	if (rc == SOCKET_ERROR)
+	{
+		Socket_error("epoll_wait", 0);
+		goto exit;
+	}
+	Log(TRACE_MAX, -1, "Return code %d from epoll_wait", rc);
+	s.nevents = rc;
+	rc = 0;
+
+	for (i = 0; i < s.nevents; ++i)
+	{
+		if (s.events[i].data.fd != SOCKET_ERROR && (s.events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			Socket_continuePendingWrite(s.events[i].data.fd);
+	}
+
+	while (s.cur_event < s.nevents)
+	{
+		if ((rc = Socket_epollReady(&(s.events[s.cur_event++]))) != 0)
+			break;
+	}
+exit:
+	Thread_unlock_mutex(mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+} /* end getReadySocket */
+#else
 /**
  *  Returns the next socket ready for communications as indicated by select
  *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
@@ -237,8 +447,12 @@ int Socket_getReadySocket(int more_work, struct timeval *tp, mutex_type mutex)
 
 	FUNC_ENTRY;
 	Thread_lock_mutex(mutex);
+#if !defined(SOCKET_WAKE)
 	if (s.clientsds->count == 0)
 		goto exit;
+#endif
+	if ((rc = SocketBuffer_getReadAheadSocket(Socket_noPendingWrites)) != 0)
+		goto exit;
 
 	if (more_work)
 		timeout = zero;
@@ -269,6 +483,13 @@ int Socket_getReadySocket(int more_work, struct timeval *tp, mutex_type mutex)
 			goto exit;
 		}
 		Log(TRACE_MAX, -1, "Return code %d from read select", rc);
+#if defined(SOCKET_WAKE)
+		if (s.wakefds[0] != SOCKET_ERROR && FD_ISSET(s.wakefds[0], &(s.rset)))
+		{
+			Socket_drainWake();
+			--rc;
+		}
+#endif
 
 		if (Socket_continueWrites(&pwset) == SOCKET_ERROR)
 		{
@@ -310,6 +531,41 @@ exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 } /* end getReadySocket */
+#endif
+
+
+/**
+ *  recv through the socket's read-ahead buffer.  Small reads (headers, short packets) fill the
+ *  read-ahead buffer with whatever is available, so following reads are served without a system call.
+ *  @param socket the socket to read from
+ *  @param dest where to put the data
+ *  @param len the number of bytes wanted
+ *  @return as recv: the number of bytes read, 0 on orderly shutdown, or SOCKET_ERROR with errno set
+ */
+static int Socket_recv(int socket, char* dest, size_t len)
+{
+	size_t taken = SocketBuffer_takeReadAhead(socket, dest, len);
+	int rc = 0;
+
+	if (taken == len)
+		return (int)taken;
+	if (len - taken >= SOCKETBUFFER_READAHEAD)
+		rc = recv(socket, dest + taken, (int)(len - taken), 0);
+	else
+	{
+		size_t space = 0;
+		char* buf = SocketBuffer_getReadAheadSpace(socket, &space);
+
+		if ((rc = recv(socket, buf, (int)space, 0)) > 0)
+		{
+			SocketBuffer_readAheadFilled(socket, rc);
+			rc = (int)SocketBuffer_takeReadAhead(socket, dest + taken, len - taken);
+		}
+	}
+	if (taken > 0 && rc <= 0)
+		return (int)taken; /* report what we have, any error or shutdown is seen on the next read */
+	return (int)taken + rc;
+}
 
 
 /**
@@ -326,7 +582,7 @@ int Socket_getch(int socket, char* c)
 	if ((rc = SocketBuffer_getQueuedChar(socket, c)) != SOCKETBUFFER_INTERRUPTED)
 		goto exit;
 
-	if ((rc = recv(socket, c, (size_t)1, 0)) == SOCKET_ERROR)
+	if ((rc = Socket_recv(socket, c, (size_t)1)) == SOCKET_ERROR)
 	{
 		int err = Socket_error("recv - getch", socket);
 		if (err == EWOULDBLOCK || err == EAGAIN)
@@ -370,7 +626,7 @@ char *Socket_getdata(int socket, size_t bytes, size_t* actual_len)
 
 	buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
 
-	if ((rc = recv(socket, buf + (*actual_len), (int)(bytes - (*actual_len)), 0)) == SOCKET_ERROR)
+	if ((rc = Socket_recv(socket, buf + (*actual_len), bytes - (*actual_len))) == SOCKET_ERROR)
 	{
 		rc = Socket_error("recv - getdata", socket);
 		if (rc != EAGAIN && rc != EWOULDBLOCK)
@@ -512,6 +768,36 @@ int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** bu
 	for (i = 0; i < count; i++)
 		total += buflens[i];
 
+	/* a packet for a socket with batched packets joins the batch, so it can't overtake them */
+	if (batch.socket == socket && (batch.count > 0 || (batch.active && total < batch.max_bytes)))
+	{
+		if (batch.len + total > batch.size)
+		{
+			char* newbuf = batch.buf ? realloc(batch.buf, batch.len + total) : malloc(batch.len + total);
+
+			if (newbuf == NULL)
+			{
+				rc = SOCKET_ERROR;
+				goto exit;
+			}
+			batch.buf = newbuf;
+			batch.size = batch.len + total;
+		}
+		memcpy(&batch.buf[batch.len], buf0, buf0len);
+		batch.len += buf0len;
+		for (i = 0; i < count; i++)
+		{
+			memcpy(&batch.buf[batch.len], buffers[i], buflens[i]);
+			batch.len += buflens[i];
+		}
+		++(batch.count);
+		/* the packet is ours now, so a failed flush shows up as a socket error on the next read */
+		if (!batch.active || batch.len >= batch.max_bytes || batch.count >= batch.max_count)
+			Socket_flushBatch();
+		rc = TCPSOCKET_COMPLETE;
+		goto exit;
+	}
+
 	iovecs[0].iov_base = buf0;
 	iovecs[0].iov_len = (ULONG)buf0len;
 	frees1[0] = 1; /* this buffer should be freed by SocketBuffer if the write is interrupted */
@@ -539,7 +825,7 @@ int Socket_putdatas(int socket, char* buf0, size_t buf0len, int count, char** bu
 #endif
 			*sockmem = socket;
 			ListAppend(s.write_pending, sockmem, sizeof(int));
-			FD_SET(socket, &(s.pending_wset));
+			Socket_addPendingWrite(socket);
 			rc = TCPSOCKET_INTERRUPTED;
 		}
 	}
@@ -555,6 +841,78 @@ exit:
 }
 
 
+/**
+ *  Set the thresholds at which batched writes are flushed.
+ *  @param max_bytes flush once at least this many bytes are batched
+ *  @param max_count flush once this many packets are batched, less than 2 turns batching off
+ */
+void Socket_setBatchLimits(size_t max_bytes, int max_count)
+{
+	batch.max_bytes = max_bytes;
+	batch.max_count = max_count;
+}
+
+
+/**
+ *  Start or stop batching writes.  While batching, Socket_putdatas on the socket copies each packet
+ *  into the batch and reports it complete, and the batch is written in one go when it reaches its
+ *  limits or Socket_flushBatch is called.  Packets already batched for another socket are flushed.
+ *  @param socket the socket to batch writes for, or 0 to stop batching
+ */
+void Socket_batchWrites(int socket)
+{
+	if (socket == 0 || batch.max_count < 2)
+		batch.active = 0;
+	else
+	{
+		if (batch.count > 0 && batch.socket != socket)
+			Socket_flushBatch();
+		batch.socket = socket;
+		batch.active = 1;
+	}
+}
+
+
+/**
+ *  @return the number of packets waiting in the batch
+ */
+int Socket_batchCount(void)
+{
+	return batch.count;
+}
+
+
+/**
+ *  Write out any batched packets.
+ *  @return completion code, as for Socket_putdatas
+ */
+int Socket_flushBatch(void)
+{
+	int rc = TCPSOCKET_COMPLETE;
+	int active = batch.active;
+	size_t len = batch.len;
+
+	FUNC_ENTRY;
+	if (batch.count == 0)
+		goto exit;
+	batch.count = 0;
+	batch.len = 0;
+	batch.active = 0;
+	rc = Socket_putdatas(batch.socket, batch.buf, len, 0, NULL, NULL, NULL);
+	batch.active = active;
+	if (rc == TCPSOCKET_INTERRUPTED)
+	{ /* the rest of the buffer is now the socket's pending write, and will be freed with it */
+		batch.buf = NULL;
+		batch.size = 0;
+	}
+	else if (rc == SOCKET_ERROR)
+		Log(LOG_ERROR, -1, "Failed to write %d batched bytes to socket %d", (int)len, batch.socket);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  *  Add a socket to the pending write list, so that it is checked for writing in select.  This is used
  *  in connect processing when the TCP connect is incomplete, as we need to check the socket for both
@@ -563,18 +921,55 @@ exit:
  */
 void Socket_addPendingWrite(int socket)
 {
+#if defined(USE_EPOLL)
+	Socket_epollUpdate(socket, EPOLLIN | EPOLLOUT);
+#else
 	FD_SET(socket, &(s.pending_wset));
+	Socket_wake(); /* so that a select in progress starts checking for writeability */
+#endif
 }
 
 
+/**
+ *  Interrupt a wait in Socket_getReadySocket, which then returns 0.  Safe to call from any thread.
+ */
+void Socket_wake(void)
+{
+#if defined(SOCKET_WAKE)
+	char c = 0;
+
+	if (s.wakefds[1] != SOCKET_ERROR && write(s.wakefds[1], &c, 1) == SOCKET_ERROR && errno != EAGAIN)
+		Socket_error("wake", s.wakefds[1]);
+#endif
+}
+
+
+#if defined(SOCKET_WAKE)
+/**
+ *  Empty the wake pipe after Socket_getReadySocket has been woken
+ */
+static void Socket_drainWake(void)
+{
+	char buf[16];
+
+	while (read(s.wakefds[0], buf, sizeof(buf)) > 0)
+		;
+}
+#endif
+
+
 /**
  *  Clear a socket from the pending write list - if one was added with Socket_addPendingWrite
  *  @param socket the socket to remove
  */
 void Socket_clearPendingWrite(int socket)
 {
+#if defined(USE_EPOLL)
+	Socket_epollUpdate(socket, EPOLLIN);
+#else
 	if (FD_ISSET(socket, &(s.pending_wset)))
 		FD_CLR(socket, &(s.pending_wset));
+#endif
 }
 
 
@@ -614,12 +1009,29 @@ int Socket_close_only(int socket)
 void Socket_close(int socket)
 {
 	FUNC_ENTRY;
+#if defined(USE_EPOLL)
+	{
+		int i;
+
+		if (epoll_ctl(s.epfd, EPOLL_CTL_DEL, socket, NULL) == SOCKET_ERROR)
+			Socket_error("epoll_ctl", socket);
+		for (i = s.cur_event; i < s.nevents; ++i)
+		{
+			if (s.events[i].data.fd == socket)
+				s.events[i].data.fd = SOCKET_ERROR;
+		}
+	}
+	Socket_close_only(socket);
+#else
 	Socket_close_only(socket);
 	FD_CLR(socket, &(s.rset_saved));
 	if (FD_ISSET(socket, &(s.pending_wset)))
 		FD_CLR(socket, &(s.pending_wset));
 	if (s.cur_clientsds != NULL && *(int*)(s.cur_clientsds->content) == socket)
 		s.cur_clientsds = s.cur_clientsds->next;
+#endif
+	if (batch.socket == socket)
+		batch.count = batch.len = batch.active = 0;
 	Socket_abortWrite(socket);
 	SocketBuffer_cleanup(socket);
 	ListRemoveItem(s.connect_pending, &socket, intcompare);
@@ -629,17 +1041,22 @@ void Socket_close(int socket)
 		Log(TRACE_MIN, -1, "Removed socket %d", socket);
 	else
 		Log(LOG_ERROR, -1, "Failed to remove socket %d", socket);
+#if !defined(USE_EPOLL)
 	if (socket + 1 >= s.maxfdp1)
 	{
 		/* now we have to reset s.maxfdp1 */
 		ListElement* cur_clientsds = NULL;
 
 		s.maxfdp1 = 0;
+#if defined(SOCKET_WAKE)
+		s.maxfdp1 = max(s.wakefds[0], s.maxfdp1);
+#endif
 		while (ListNextElement(s.clientsds, &cur_clientsds))
 			s.maxfdp1 = max(*((int*)(cur_clientsds->content)), s.maxfdp1);
 		++(s.maxfdp1);
 		Log(TRACE_MAX, -1, "Reset max fdp1 to %d", s.maxfdp1);
 	}
+#endif
 	FUNC_EXIT;
 }
 
@@ -905,6 +1322,30 @@ exit:
 }
 
 
+#if defined(USE_EPOLL)
+/**
+ *  Continue the outstanding write, if any, for a socket reported writeable by epoll
+ *  @param socket the socket
+ */
+static void Socket_continuePendingWrite(int socket)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (ListFindItem(s.write_pending, &socket, intcompare) && ((rc = Socket_continueWrite(socket)) != 0))
+	{
+		if (!SocketBuffer_writeComplete(socket))
+			Log(LOG_SEVERE, -1, "Failed to remove pending write from socket buffer list");
+		Socket_clearPendingWrite(socket);
+		if (!ListRemoveItem(s.write_pending, &socket, intcompare))
+			Log(LOG_SEVERE, -1, "Failed to remove pending write from list");
+
+		if (writecomplete)
+			(*writecomplete)(socket, rc);
+	}
+	FUNC_EXIT;
+}
+#else
 /**
  *  Continue any outstanding writes for a socket set
  *  @param pwset the set of sockets
@@ -942,6 +1383,7 @@ int Socket_continueWrites(fd_set* pwset)
 	FUNC_EXIT_RC(rc1);
 	return rc1;
 }
+#endif
 
 
 /**
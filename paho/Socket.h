@@ -67,6 +67,19 @@
 
 #include "mutex_type.h" /* Needed for mutex_type */
 
+#if !defined(WIN32) && !defined(WIN64)
+/** Socket_getReadySocket can be interrupted with Socket_wake */
+#define SOCKET_WAKE 1
+#endif
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+/** use epoll rather than select to wait for socket readiness */
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+/** maximum number of ready sockets taken from one epoll_wait call */
+#define SOCKET_MAX_EVENTS 16
+#endif
+
 /** socket operation completed successfully */
 #define TCPSOCKET_COMPLETE 0
 #if !defined(SOCKET_ERROR)
@@ -121,6 +134,15 @@ typedef struct
 	List* connect_pending; /**< list of sockets for which a connect is pending */
 	List* write_pending; /**< list of sockets for which a write is pending */
 	fd_set pending_wset; /**< socket pending write set for select */
+#if defined(SOCKET_WAKE)
+	int wakefds[2]; /**< pipe whose read end is always waited on, written by Socket_wake */
+#endif
+#if defined(USE_EPOLL)
+	int epfd; /**< epoll instance all client sockets are registered with */
+	struct epoll_event events[SOCKET_MAX_EVENTS]; /**< results of the last epoll_wait */
+	int nevents; /**< number of entries in events */
+	int cur_event; /**< next entry in events to be checked (iterator) */
+#endif
 } Sockets;
 
 
@@ -138,6 +160,12 @@ char* Socket_getpeer(int sock);
 
 void Socket_addPendingWrite(int socket);
 void Socket_clearPendingWrite(int socket);
+void Socket_wake(void);
+
+void Socket_setBatchLimits(size_t max_bytes, int max_count);
+void Socket_batchWrites(int socket);
+int Socket_batchCount(void);
+int Socket_flushBatch(void);
 
 typedef void Socket_writeComplete(int socket, int rc);
 void Socket_setWriteCompleteCallback(Socket_writeComplete*);
@@ -54,11 +54,17 @@ static List* queues;
  */
 static List writes;
 
+/**
+ * List of read-ahead buffers, one per socket that has been read from
+ */
+static List readaheads;
+
 
 int socketcompare(void* a, void* b);
 void SocketBuffer_newDefQ(void);
 void SocketBuffer_freeDefQ(void);
 int pending_socketcompare(void* a, void* b);
+static int readahead_socketcompare(void* a, void* b);
 
 
 /**
@@ -95,6 +101,7 @@ void SocketBuffer_initialize(void)
 	SocketBuffer_newDefQ();
 	queues = ListInitialize();
 	ListZero(&writes);
+	ListZero(&readaheads);
 	FUNC_EXIT;
 }
 
@@ -117,6 +124,7 @@ void SocketBuffer_terminate(void)
 {
 	ListElement* cur = NULL;
 	ListEmpty(&writes);
+	ListEmpty(&readaheads);
 
 	FUNC_ENTRY;
 	while (ListNextElement(queues, &cur))
@@ -135,6 +143,7 @@ void SocketBuffer_cleanup(int socket)
 {
 	FUNC_ENTRY;
 	SocketBuffer_writeComplete(socket); /* clean up write buffers */
+	ListRemoveItem(&readaheads, &socket, readahead_socketcompare);
 	if (ListFindItem(queues, &socket, socketcompare))
 	{
 		free(((socket_queue*)(queues->current->content))->buf);
@@ -413,3 +422,101 @@ pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload)
 	FUNC_EXIT;
 	return pw;
 }
+
+
+/**
+ * List callback function for comparing read_aheads by socket
+ * @param a first integer value
+ * @param b second integer value
+ * @return boolean indicating whether a and b are equal
+ */
+static int readahead_socketcompare(void* a, void* b)
+{
+	return ((read_ahead*)a)->socket == *(int*)b;
+}
+
+
+/**
+ * Copy unread data out of the read-ahead buffer of a socket
+ * @param socket the socket
+ * @param dest where to copy the data to
+ * @param len the maximum number of bytes to copy
+ * @return the number of bytes copied, 0 if there was nothing buffered
+ */
+size_t SocketBuffer_takeReadAhead(int socket, char* dest, size_t len)
+{
+	ListElement* le = ListFindItem(&readaheads, &socket, readahead_socketcompare);
+	read_ahead* ra = NULL;
+
+	if (le == NULL)
+		return 0;
+	ra = (read_ahead*)(le->content);
+	if (len > ra->end - ra->start)
+		len = ra->end - ra->start;
+	memcpy(dest, &ra->buf[ra->start], len);
+	ra->start += len;
+	if (ra->start == ra->end)
+		ra->start = ra->end = 0;
+	return len;
+}
+
+
+/**
+ * Get the read-ahead buffer of a socket to recv into.  Only valid once the buffer has been emptied
+ * with SocketBuffer_takeReadAhead.
+ * @param socket the socket
+ * @param space returns the number of bytes that can be read into the buffer
+ * @return the buffer
+ */
+char* SocketBuffer_getReadAheadSpace(int socket, size_t* space)
+{
+	ListElement* le = ListFindItem(&readaheads, &socket, readahead_socketcompare);
+	read_ahead* ra = NULL;
+
+	if (le)
+		ra = (read_ahead*)(le->content);
+	else
+	{
+		ra = malloc(sizeof(read_ahead));
+		ra->socket = socket;
+		ra->start = ra->end = 0;
+		ListAppend(&readaheads, ra, sizeof(read_ahead));
+	}
+	*space = sizeof(ra->buf) - ra->end;
+	return &ra->buf[ra->end];
+}
+
+
+/**
+ * Record data read into the space returned by SocketBuffer_getReadAheadSpace
+ * @param socket the socket
+ * @param len the number of bytes read
+ */
+void SocketBuffer_readAheadFilled(int socket, size_t len)
+{
+	ListElement* le = ListFindItem(&readaheads, &socket, readahead_socketcompare);
+
+	if (le)
+		((read_ahead*)(le->content))->end += len;
+}
+
+
+/**
+ * Find a socket which still has data in its read-ahead buffer.  The kernel no longer reports
+ * such a socket as readable, so select or epoll would not return it.
+ * @param ready callback deciding whether the socket can be handed out now
+ * @return the socket, or 0 if there is none
+ */
+int SocketBuffer_getReadAheadSocket(int (*ready)(int socket))
+{
+	ListElement* current = NULL;
+
+	while (ListNextElement(&readaheads, &current))
+	{
+		read_ahead* ra = (read_ahead*)(current->content);
+
+		if (ra->end > ra->start && (*ready)(ra->socket))
+			return ra->socket;
+	}
+	return 0;
+}
@@ -57,6 +57,17 @@ typedef struct
 	int frees[5];
 } pending_writes;
 
+/** size of the per-socket read-ahead buffer that small reads are served from */
+#define SOCKETBUFFER_READAHEAD 4096
+
+typedef struct
+{
+	int socket;
+	size_t start, /**< offset of the first unread byte in buf */
+		end; /**< offset one past the last unread byte in buf */
+	char buf[SOCKETBUFFER_READAHEAD];
+} read_ahead;
+
 #define SOCKETBUFFER_COMPLETE 0
 #if !defined(SOCKET_ERROR)
 	#define SOCKET_ERROR -1
@@ -81,4 +92,9 @@ pending_writes* SocketBuffer_getWrite(int socket);
 int SocketBuffer_writeComplete(int socket);
 pending_writes* SocketBuffer_updateWrite(int socket, char* topic, char* payload);
 
+size_t SocketBuffer_takeReadAhead(int socket, char* dest, size_t len);
+char* SocketBuffer_getReadAheadSpace(int socket, size_t* space);
+void SocketBuffer_readAheadFilled(int socket, size_t len);
+int SocketBuffer_getReadAheadSocket(int (*ready)(int socket));
+
 #endif
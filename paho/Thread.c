@@ -339,13 +339,15 @@ cond_type Thread_create_cond(void)
 	condvar = malloc(sizeof(cond_type_struct));
 	rc = pthread_cond_init(&condvar->cond, NULL);
 	rc = pthread_mutex_init(&condvar->mutex, NULL);
+	condvar->signalled = 0;
 
 	FUNC_EXIT_RC(rc);
 	return condvar;
 }
 
 /**
- * Signal a condition variable
+ * Signal a condition variable.  The signal is remembered until the next wait, so it is not
+ * lost when nobody is waiting yet.
  * @return completion code
  */
 int Thread_signal_cond(cond_type condvar)
@@ -353,6 +355,7 @@ int Thread_signal_cond(cond_type condvar)
 	int rc = 0;
 
 	pthread_mutex_lock(&condvar->mutex);
+	condvar->signalled = 1;
 	rc = pthread_cond_signal(&condvar->cond);
 	pthread_mutex_unlock(&condvar->mutex);
 
@@ -360,10 +363,11 @@ int Thread_signal_cond(cond_type condvar)
 }
 
 /**
- * Wait with a timeout (seconds) for condition variable
- * @return completion code
+ * Wait with a timeout (milliseconds, negative for none) for a condition variable to be signalled,
+ * returns at once if it was signalled since the last wait
+ * @return completion code, ETIMEDOUT if the timeout expired
  */
-int Thread_wait_cond(cond_type condvar, int timeout)
+int Thread_wait_cond(cond_type condvar, long timeout)
 {
 	FUNC_ENTRY;
 	int rc = 0;
@@ -372,11 +376,25 @@ int Thread_wait_cond(cond_type condvar, int timeout)
 
 	gettimeofday(&cur_time, NULL);
 
-	cond_timeout.tv_sec = cur_time.tv_sec + timeout;
-	cond_timeout.tv_nsec = cur_time.tv_usec * 1000;
+	cond_timeout.tv_sec = cur_time.tv_sec + timeout / 1000;
+	cond_timeout.tv_nsec = cur_time.tv_usec * 1000 + (timeout % 1000) * 1000000L;
+	if (cond_timeout.tv_nsec >= 1000000000L)
+	{
+		cond_timeout.tv_sec++;
+		cond_timeout.tv_nsec -= 1000000000L;
+	}
 
 	pthread_mutex_lock(&condvar->mutex);
-	rc = pthread_cond_timedwait(&condvar->cond, &condvar->mutex, &cond_timeout);
+	while (!condvar->signalled && rc == 0)
+	{
+		if (timeout < 0)
+			rc = pthread_cond_wait(&condvar->cond, &condvar->mutex);
+		else
+			rc = pthread_cond_timedwait(&condvar->cond, &condvar->mutex, &cond_timeout);
+	}
+	if (condvar->signalled)
+		rc = 0;
+	condvar->signalled = 0;
 	pthread_mutex_unlock(&condvar->mutex);
 
 	FUNC_EXIT_RC(rc);
@@ -38,7 +38,7 @@
 	#define thread_id_type pthread_t
 	#define thread_return_type void*
 	typedef thread_return_type (*thread_fn)(void*);
-	typedef struct { pthread_cond_t cond; pthread_mutex_t mutex; } cond_type_struct;
+	typedef struct { pthread_cond_t cond; pthread_mutex_t mutex; int signalled; } cond_type_struct;
 	typedef cond_type_struct *cond_type;
 	#if defined(OSX)
 	  #include <dispatch/dispatch.h>
@@ -50,7 +50,7 @@
 
 	cond_type Thread_create_cond(void);
 	int Thread_signal_cond(cond_type);
-	int Thread_wait_cond(cond_type condvar, int timeout);
+	int Thread_wait_cond(cond_type condvar, long timeout);
 	int Thread_destroy_cond(cond_type);
 #endif
 
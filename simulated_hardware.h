@@ -0,0 +1,216 @@
+#pragma once
+
+#include "hardware.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs the relay against a fake device tree in a temp dir, for host builds. The relay,
+// screen and sensor nodes are plain files, button values and input devices are FIFOs.
+// Events can be injected with the methods below, by a script (see runScript) or from a
+// shell, e.g. `printf 0 > <root>/sys/class/gpio/gpio8/value` presses button 0.
+class SimulatedHardware : public SysfsHardware {
+public:
+  SimulatedHardware()
+  : SysfsHardware(makeRoot()) {
+    const char* dirs[] = { "/sys", "/sys/class", "/sys/class/gpio", BUTTON_0_GPIO, BUTTON_1_GPIO, RELAY_0_GPIO, RELAY_1_GPIO,
+                           "/sys/class/gpio/gpio30", "/sys/bus", "/sys/bus/i2c", "/sys/bus/i2c/devices",
+                           "/sys/bus/i2c/devices/2-0040", "/dev", "/dev/input" };
+    for (const char* d : dirs) {
+      mkdir(path(d).c_str(), 0755);
+    }
+    const char* files[] = { BUTTON_0_GPIO"edge", BUTTON_1_GPIO"edge", RELAY_0_GPIO"value", RELAY_1_GPIO"value",
+                            SCREEN_STATE, TEMPERATURE_DATA, HUMIDITY_DATA };
+    for (const char* f : files) {
+      m_files.push_back(path(f));
+      writeValue(f, "0");
+    }
+    setTemperature(21000);
+    setHumidity(40000);
+
+    const char* fifos[] = { BUTTON_0_GPIO"value", BUTTON_1_GPIO"value", SCREEN_INPUT_EVENTS, PROXIMITY_INPUT_EVENTS };
+    for (int i = 0; i < 4; ++i) {
+      m_files.push_back(path(fifos[i]));
+      mkfifo(m_files.back().c_str(), 0644);
+      // our own end stays open, so readers never see a hangup and shell writers never block
+      m_fifoFds[i] = ::open(m_files.back().c_str(), O_RDWR | O_NONBLOCK);
+    }
+  }
+
+  ~SimulatedHardware() override {
+    m_scriptRunning = false;
+    if (m_script.joinable()) {
+      m_script.join();
+    }
+    for (int fd : m_fifoFds) {
+      close(fd);
+    }
+    for (auto const& f : m_files) {
+      unlink(f.c_str());
+    }
+    const char* dirs[] = { "/dev/input", "/dev", "/sys/bus/i2c/devices/2-0040", "/sys/bus/i2c/devices", "/sys/bus/i2c", "/sys/bus",
+                           "/sys/class/gpio/gpio30", RELAY_1_GPIO, RELAY_0_GPIO, BUTTON_1_GPIO, BUTTON_0_GPIO,
+                           "/sys/class/gpio", "/sys/class", "/sys", "" };
+    for (const char* d : dirs) {
+      rmdir(path(d).c_str());
+    }
+  }
+
+  std::string const& root() const {
+    return m_root;
+  }
+
+  // FIFOs only raise POLLIN
+  short buttonPollEvents() override {
+    return POLLIN;
+  }
+
+  // Every level written is an edge, so a press and release queued together are both seen
+  int readButtonEdges(int button, ButtonEdge* edges, int max, std::chrono::steady_clock::time_point now) override {
+    int count = 0;
+    char c;
+    while (count < max && read(buttonFd(button), &c, 1) == 1) {
+      if (c == '0' || c == '1') {
+        edges[count++] = ButtonEdge{c == '0', now};
+      }
+    }
+    return count;
+  }
+
+  // EVIOCGRAB doesn't apply to a FIFO
+  bool grabInput(InputDevice device, bool grab) override {
+    return true;
+  }
+
+  // Injection, safe from any thread
+
+  void pressButton(int button) {
+    write(m_fifoFds[button], "0", 1);
+  }
+
+  void releaseButton(int button) {
+    write(m_fifoFds[button], "1", 1);
+  }
+
+  // flips a relay as if it had been switched outside the manager
+  void setRelay(int relay, bool state) {
+    writeValue(relay ? RELAY_1_GPIO"value" : RELAY_0_GPIO"value", state ? "1" : "0");
+  }
+
+  void setTemperature(int milliDegrees) {
+    writeInteger(TEMPERATURE_DATA, milliDegrees);
+  }
+
+  void setHumidity(int milliPercent) {
+    writeInteger(HUMIDITY_DATA, milliPercent);
+  }
+
+  void touch() {
+    struct input_event events[] = { inputEvent(EV_KEY, BTN_TOUCH, 1), inputEvent(EV_SYN, SYN_REPORT, 0) };
+    write(m_fifoFds[2], events, sizeof(events));
+  }
+
+  void proximity(int ledA) {
+    struct input_event events[] = { inputEvent(EV_ABS, ABS_DISTANCE, ledA), inputEvent(EV_SYN, SYN_REPORT, 0) };
+    write(m_fifoFds[3], events, sizeof(events));
+  }
+
+  // Plays a script of "<delay ms> <command> [args]" lines on a thread of its own, where
+  // command is press <button>, release <button>, relay <relay> <0|1>, temperature <value>,
+  // humidity <value>, touch, proximity <value> or loop (start over). '#' starts a comment.
+  bool runScript(std::string const& file) {
+    std::vector<std::string> lines;
+    FILE* f = fopen(file.c_str(), "r");
+    if (!f) {
+      return false;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+      if (line[0] != '#' && line[0] != '\n') {
+        lines.push_back(line);
+      }
+    }
+    fclose(f);
+    m_scriptRunning = true;
+    m_script = std::thread([this, lines] () {
+      size_t i = 0;
+      while (m_scriptRunning && i < lines.size()) {
+        int delay = 0, arg0 = 0, arg1 = 0;
+        char command[32] = {0};
+        if (sscanf(lines[i++].c_str(), "%d %31s %d %d", &delay, command, &arg0, &arg1) < 2) {
+          continue;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+        if (strcmp(command, "press") == 0) {
+          pressButton(arg0 ? 1 : 0);
+        } else if (strcmp(command, "release") == 0) {
+          releaseButton(arg0 ? 1 : 0);
+        } else if (strcmp(command, "relay") == 0) {
+          setRelay(arg0 ? 1 : 0, arg1);
+        } else if (strcmp(command, "temperature") == 0) {
+          setTemperature(arg0);
+        } else if (strcmp(command, "humidity") == 0) {
+          setHumidity(arg0);
+        } else if (strcmp(command, "touch") == 0) {
+          touch();
+        } else if (strcmp(command, "proximity") == 0) {
+          proximity(arg0);
+        } else if (strcmp(command, "loop") == 0) {
+          i = 0;
+        }
+      }
+    });
+    return true;
+  }
+
+protected:
+  // O_RDWR keeps the FIFO from reporting a hangup once an outside writer closes it
+  int openEventSource(std::string const& p, int flags) override {
+    return ::open(p.c_str(), O_RDWR | O_NONBLOCK);
+  }
+
+private:
+  int m_fifoFds[4];
+  std::vector<std::string> m_files;
+  std::thread m_script;
+  std::atomic<bool> m_scriptRunning{false};
+
+  static std::string makeRoot() {
+    char dir[] = "/tmp/wink_relay.XXXXXX";
+    if (!mkdtemp(dir)) {
+      perror("mkdtemp");
+      exit(EXIT_FAILURE);
+    }
+    return dir;
+  }
+
+  static struct input_event inputEvent(int type, int code, int value) {
+    struct input_event e;
+    memset(&e, 0, sizeof(e));
+    e.type = type;
+    e.code = code;
+    e.value = value;
+    return e;
+  }
+
+  void writeValue(const char* node, const char* value) {
+    int fd = ::open(path(node).c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) {
+      write(fd, value, strlen(value));
+      close(fd);
+    }
+  }
+
+  // fixed width and a single write, so a concurrent reader never sees a partial value
+  void writeInteger(const char* node, int value) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%-11d\n", value);
+    writeValue(node, buf);
+  }
+};
@@ -20,6 +20,11 @@
 #include "../sinks/sink.h"
 
 #include <chrono>
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#endif
 #include <exception>
 #include <functional>
 #include <memory>
@@ -168,6 +173,21 @@ private:
     // worker thread
     std::thread _worker_thread;
 
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+    // guards the waits below, the queue itself stays lock free
+    std::mutex _wait_mutex;
+    // the worker waits on this for messages
+    std::condition_variable _not_empty;
+    // callers wait on this for room in the queue (block_retry) or for it to drain (flush)
+    std::condition_variable _not_full;
+    std::atomic<int> _full_waiters;
+    // set while the worker waits on _not_empty, so pushes only take the lock to wake it then
+    std::atomic<bool> _consumer_waiting;
+
+    void notify_not_empty();
+    void wait_not_empty(const log_clock::time_point &last_flush);
+#endif
+
     void push_msg(async_msg &&new_msg);
 
     // worker thread main loop
@@ -204,6 +224,10 @@ inline spdlog::details::async_log_helper::async_log_helper(formatter_ptr formatt
     , _worker_warmup_cb(std::move(worker_warmup_cb))
     , _flush_interval_ms(flush_interval_ms)
     , _worker_teardown_cb(std::move(worker_teardown_cb))
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+    , _full_waiters(0)
+    , _consumer_waiting(false)
+#endif
 {
     _worker_thread = std::thread(&async_log_helper::worker_loop, this);
 }
@@ -230,6 +254,25 @@ inline void spdlog::details::async_log_helper::log(const details::log_msg &msg)
 
 inline void spdlog::details::async_log_helper::push_msg(details::async_log_helper::async_msg &&new_msg)
 {
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+    if (_q.enqueue(std::move(new_msg)))
+    {
+        notify_not_empty();
+    }
+    else if (_overflow_policy != async_overflow_policy::discard_log_msg)
+    {
+        std::unique_lock<std::mutex> lock(_wait_mutex);
+        ++_full_waiters;
+        // the timeout only guards against a wakeup lost between the worker's dequeue and our count
+        while (!_q.enqueue(std::move(new_msg)))
+        {
+            _not_full.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        --_full_waiters;
+        lock.unlock();
+        notify_not_empty();
+    }
+#else
     if (!_q.enqueue(std::move(new_msg)) && _overflow_policy != async_overflow_policy::discard_log_msg)
     {
         auto last_op_time = details::os::now();
@@ -240,6 +283,7 @@ inline void spdlog::details::async_log_helper::push_msg(details::async_log_helpe
             sleep_or_yield(now, last_op_time);
         } while (!_q.enqueue(std::move(new_msg)));
     }
+#endif
 }
 
 // optionally wait for the queue be empty and request flush from the sinks
@@ -291,6 +335,13 @@ inline bool spdlog::details::async_log_helper::process_next_msg(log_clock::time_
     if (_q.dequeue(incoming_async_msg))
     {
         last_pop = details::os::now();
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+        if (_full_waiters.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(_wait_mutex);
+            _not_full.notify_all();
+        }
+#endif
         switch (incoming_async_msg.msg_type)
         {
         case async_msg_type::flush:
@@ -321,7 +372,14 @@ inline bool spdlog::details::async_log_helper::process_next_msg(log_clock::time_
     // This is the only place where the queue can terminate or flush to avoid losing messages already in the queue
     auto now = details::os::now();
     handle_flush_interval(now, last_flush);
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+    if (!_terminate_requested)
+    {
+        wait_not_empty(last_flush);
+    }
+#else
     sleep_or_yield(now, last_pop);
+#endif
     return !_terminate_requested;
 }
 
@@ -377,14 +435,56 @@ inline void spdlog::details::async_log_helper::sleep_or_yield(
     return details::os::sleep_for_millis(500);
 }
 
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+inline void spdlog::details::async_log_helper::notify_not_empty()
+{
+    // pairs with the fence in wait_not_empty: either the worker sees the new message
+    // before it waits, or we see it waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!_consumer_waiting.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    // taking the lock orders this after the worker's check of the queue
+    {
+        std::lock_guard<std::mutex> lock(_wait_mutex);
+    }
+    _not_empty.notify_one();
+}
+
+// block until there is a message, or the next periodic flush is due.
+// the queue is empty when we get here, so let anyone in wait_empty_q go first
+inline void spdlog::details::async_log_helper::wait_not_empty(const log_clock::time_point &last_flush)
+{
+    std::unique_lock<std::mutex> lock(_wait_mutex);
+    _not_full.notify_all();
+    _consumer_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_flush_interval_ms == std::chrono::milliseconds::zero())
+    {
+        _not_empty.wait(lock, [this] { return !_q.is_empty(); });
+    }
+    else
+    {
+        _not_empty.wait_until(lock, last_flush + _flush_interval_ms, [this] { return !_q.is_empty(); });
+    }
+    _consumer_waiting.store(false, std::memory_order_relaxed);
+}
+#endif
+
 // wait for the queue to be empty
 inline void spdlog::details::async_log_helper::wait_empty_q()
 {
+#ifdef SPDLOG_ASYNC_BLOCKING_WAIT
+    std::unique_lock<std::mutex> lock(_wait_mutex);
+    _not_full.wait(lock, [this] { return _q.is_empty(); });
+#else
     auto last_op = details::os::now();
     while (!_q.is_empty())
     {
         sleep_or_yield(details::os::now(), last_op);
     }
+#endif
 }
 
 inline void spdlog::details::async_log_helper::set_error_handler(spdlog::log_err_handler err_handler)
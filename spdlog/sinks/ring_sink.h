@@ -0,0 +1,159 @@
+//
+// Copyright(c) 2026 wink-relay-manager contributors.
+// Distributed under the MIT License (http://opensource.org/licenses/MIT)
+//
+
+#pragma once
+
+#include "../details/log_msg.h"
+#include "sink.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace spdlog {
+namespace sinks {
+
+/*
+ * Flight recorder sink: keeps the last formatted records in a fixed ring in memory.
+ * No allocation or I/O after construction, so it can stay attached at debug level
+ * and be read back after something went wrong.
+ *
+ * Writers claim a slot with a single fetch_add and publish it through a per slot
+ * sequence number, so logging threads never wait on each other or on a reader.
+ * A record is dropped instead if its slot doesn't hold the complete record of the
+ * lap before, e.g. because a writer a full lap behind is still writing it. The slot
+ * then gets an empty record in its place, which readers skip, so the next lap finds
+ * what it expects. Records longer than the slot are truncated.
+ */
+class ring_sink : public sink
+{
+public:
+    // records is rounded up to a power of 2
+    explicit ring_sink(size_t records = 256, size_t record_size = 256)
+        : _record_size(record_size)
+    {
+        size_t n = 1;
+        while (n < records)
+        {
+            n <<= 1;
+        }
+        _mask = n - 1;
+        _slots.reset(new slot[n]);
+        _text.reset(new char[n * record_size]);
+    }
+
+    ring_sink(const ring_sink &) = delete;
+    ring_sink &operator=(const ring_sink &) = delete;
+
+    void log(const details::log_msg &msg) override
+    {
+        size_t index = _head.fetch_add(1, std::memory_order_relaxed);
+        slot &s = _slots[index & _mask];
+        // the complete record of the lap before, or the initial 0 on the first lap
+        size_t seq = index <= _mask ? 0 : 2 * (index - _mask - 1) + 2;
+        if (!s.seq.compare_exchange_strong(seq, 2 * index + 1, std::memory_order_acquire))
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            skip(s, index, seq);
+            return;
+        }
+        size_t len = std::min(msg.formatted.size(), _record_size);
+        std::memcpy(text(index), msg.formatted.data(), len);
+        publish(s, index, len);
+    }
+
+    void flush() override {}
+
+    // Up to limit of the most recent records (0 for all that are held), oldest first.
+    // Records overwritten while being copied, and dropped ones, are skipped.
+    std::vector<std::string> last_formatted(size_t limit = 0) const
+    {
+        size_t head = _head.load(std::memory_order_acquire);
+        size_t count = std::min(head, _mask + 1);
+        if (limit && limit < count)
+        {
+            count = limit;
+        }
+        std::vector<std::string> records;
+        records.reserve(count);
+        std::string record;
+        for (size_t index = head - count; index != head; ++index)
+        {
+            const slot &s = _slots[index & _mask];
+            if (s.seq.load(std::memory_order_acquire) != 2 * index + 2)
+            {
+                continue;
+            }
+            record.assign(text(index), s.len);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) == 2 * index + 2 && !record.empty())
+            {
+                records.push_back(record);
+            }
+        }
+        return records;
+    }
+
+    // records lost to a slot that was still being written
+    size_t dropped() const
+    {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct slot
+    {
+        // 2 * index + 1 while record index is written, 2 * index + 2 once it is complete
+        std::atomic<size_t> seq{0};
+        size_t len{0};
+    };
+
+    // Leaves an empty record for the dropped record index, unless the slot is already on a
+    // later lap. A slot still being written by an older writer is handed over to index, and
+    // that writer publishes the empty record once it is done.
+    void skip(slot &s, size_t index, size_t seq)
+    {
+        while (seq < 2 * index + 1)
+        {
+            if (s.seq.compare_exchange_strong(seq, 2 * index + 1, std::memory_order_acquire))
+            {
+                if (!(seq & 1))
+                {
+                    publish(s, index, 0);
+                }
+                return;
+            }
+        }
+    }
+
+    // completes the record owned by this writer, or the empty one of a writer that took the slot over
+    void publish(slot &s, size_t index, size_t len)
+    {
+        size_t seq = 2 * index + 1;
+        s.len = len;
+        while (!s.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_release, std::memory_order_relaxed))
+        {
+            s.len = 0;
+        }
+    }
+
+    char *text(size_t index) const
+    {
+        return &_text[(index & _mask) * _record_size];
+    }
+
+    size_t _record_size;
+    size_t _mask;
+    std::unique_ptr<slot[]> _slots;
+    std::unique_ptr<char[]> _text;
+    std::atomic<size_t> _head{0};
+    std::atomic<size_t> _dropped{0};
+};
+
+} // namespace sinks
+} // namespace spdlog
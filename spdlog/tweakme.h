@@ -141,3 +141,12 @@
 //
 // #define SPDLOG_LEVEL_NAMES { "MY TRACE", "MY DEBUG", "MY INFO", "MY WARNING", "MY ERROR", "MY CRITICAL", "OFF" }
 ///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Define to make the async logger's worker thread (and callers waiting
+// for room in a full queue, or for the queue to drain) block on a condition
+// variable, instead of spinning, yielding and sleeping 20ms/500ms at a time.
+// wink_manager defines it in Android.mk, so it is on in the device and host builds.
+//
+// #define SPDLOG_ASYNC_BLOCKING_WAIT
+///////////////////////////////////////////////////////////////////////////////
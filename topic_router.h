@@ -0,0 +1,192 @@
+#pragma once
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+// A single topic level, pointing into the topic being dispatched
+struct TopicLevel {
+  const char* data = nullptr;
+  size_t size = 0;
+
+  bool equals(const char* s, size_t n) const {
+    return size == n && strncmp(data, s, n) == 0;
+  }
+
+  // non-negative decimal level, -1 when it isn't one or is out of int range
+  int toInt() const {
+    int v = 0;
+    for (size_t i = 0; i < size; ++i) {
+      if (data[i] < '0' || data[i] > '9' || v > (INT_MAX - (data[i] - '0')) / 10) {
+        return -1;
+      }
+      v = v * 10 + (data[i] - '0');
+    }
+    return size ? v : -1;
+  }
+};
+
+// Levels matched by the wildcards of a route, in order. A trailing '#' is
+// reported as one level spanning the rest of the topic.
+struct TopicMatch {
+  static const int MAX_WILDCARDS = 4;
+  TopicLevel wildcards[MAX_WILDCARDS];
+  int count = 0;
+};
+
+// Routes topics under a fixed prefix to handlers through a trie of levels.
+// Routes are added once at startup (allocating), dispatch walks the trie over
+// the incoming topic in place and does not allocate. Exact levels win over '+'
+// which wins over '#'.
+template<typename Message>
+class TopicRouter {
+public:
+  using Handler = std::function<void(TopicMatch const& match, Message msg)>;
+
+  explicit TopicRouter(std::string const& prefix = std::string())
+  : m_prefix(prefix), m_root(new Node()) {}
+
+  void setPrefix(std::string const& prefix) {
+    m_prefix = prefix;
+  }
+
+  // filter is relative to the prefix, e.g. "relays/+" or "command/#"
+  bool add(std::string const& filter, Handler handler) {
+    Node* node = m_root.get();
+    size_t start = 0;
+    int wildcards = 0;
+    while (true) {
+      size_t end = filter.find('/', start);
+      std::string level = filter.substr(start, end == std::string::npos ? std::string::npos : end - start);
+      if (level == "#") {
+        if (end != std::string::npos || ++wildcards > TopicMatch::MAX_WILDCARDS) {
+          return false;
+        }
+        if (!node->multi) {
+          node->multi.reset(new Node());
+        }
+        node = node->multi.get();
+        break;
+      } else if (level == "+") {
+        if (++wildcards > TopicMatch::MAX_WILDCARDS) {
+          return false;
+        }
+        if (!node->single) {
+          node->single.reset(new Node());
+        }
+        node = node->single.get();
+      } else {
+        node = node->child(level);
+      }
+      if (end == std::string::npos) {
+        break;
+      }
+      start = end + 1;
+    }
+    node->handler = std::move(handler);
+    m_filters.push_back(m_prefix.empty() ? filter : m_prefix + "/" + filter);
+    return true;
+  }
+
+  // Full topic filters to subscribe to, prefix included
+  std::vector<std::string> const& filters() const {
+    return m_filters;
+  }
+
+  // len may be 0 for a nul-terminated topic, as with MQTTAsync_messageArrived
+  bool dispatch(const char* topic, size_t len, Message msg) const {
+    if (len == 0) {
+      len = strlen(topic);
+    }
+    const char* end = topic + len;
+    if (!m_prefix.empty()) {
+      if (len <= m_prefix.size() || strncmp(topic, m_prefix.c_str(), m_prefix.size()) != 0 || topic[m_prefix.size()] != '/') {
+        return false;
+      }
+      topic += m_prefix.size() + 1;
+    }
+    TopicMatch match;
+    const Node* node = find(m_root.get(), topic, end, match);
+    if (!node) {
+      return false;
+    }
+    node->handler(match, msg);
+    return true;
+  }
+
+private:
+  struct Node {
+    std::vector<std::pair<std::string, std::unique_ptr<Node>>> children;
+    std::unique_ptr<Node> single;
+    std::unique_ptr<Node> multi;
+    Handler handler;
+
+    Node* child(std::string const& level) {
+      for (auto& c : children) {
+        if (c.first == level) {
+          return c.second.get();
+        }
+      }
+      children.emplace_back(level, std::unique_ptr<Node>(new Node()));
+      return children.back().second.get();
+    }
+
+    const Node* child(const char* level, size_t size) const {
+      for (auto const& c : children) {
+        if (c.first.size() == size && strncmp(c.first.c_str(), level, size) == 0) {
+          return c.second.get();
+        }
+      }
+      return nullptr;
+    }
+  };
+
+  // topic points at the start of the next level, or at end once all levels are consumed
+  static const Node* find(const Node* node, const char* topic, const char* end, TopicMatch& match) {
+    if (topic > end) {
+      // consumed the last level: '#' also matches its parent level
+      if (node->handler) {
+        return node;
+      }
+      if (node->multi && node->multi->handler && match.count < TopicMatch::MAX_WILDCARDS) {
+        match.wildcards[match.count++] = TopicLevel{end, 0};
+        return node->multi.get();
+      }
+      return nullptr;
+    }
+    const char* sep = static_cast<const char*>(memchr(topic, '/', end - topic));
+    const char* levelEnd = sep ? sep : end;
+    size_t size = levelEnd - topic;
+    const char* next = levelEnd + 1;
+
+    const Node* exact = node->child(topic, size);
+    if (exact) {
+      const Node* found = find(exact, next, end, match);
+      if (found) {
+        return found;
+      }
+    }
+    if (node->single && match.count < TopicMatch::MAX_WILDCARDS) {
+      int mark = match.count;
+      match.wildcards[match.count++] = TopicLevel{topic, size};
+      const Node* found = find(node->single.get(), next, end, match);
+      if (found) {
+        return found;
+      }
+      match.count = mark;
+    }
+    if (node->multi && node->multi->handler && match.count < TopicMatch::MAX_WILDCARDS) {
+      match.wildcards[match.count++] = TopicLevel{topic, static_cast<size_t>(end - topic)};
+      return node->multi.get();
+    }
+    return nullptr;
+  }
+
+  std::string m_prefix;
+  std::unique_ptr<Node> m_root;
+  std::vector<std::string> m_filters;
+};
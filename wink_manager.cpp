@@ -1,27 +1,52 @@
 #include "wink_relay.h"
+#include "simulated_hardware.h"
+#if defined(__has_include)
+#if __has_include(<linux/gpio.h>)
+#include <linux/gpio.h>
+#endif
+#endif
+#ifdef GPIO_GET_LINEEVENT_IOCTL
+#include "gpiochip_hardware.h"
+#endif
+#include "topic_router.h"
 
 #include "MQTTAsync.h"
 #include "ini.h"
 #include "spdlog/spdlog.h"
+#include "spdlog/sinks/ring_sink.h"
 
-#include <map>
 #include <functional>
+#include <mutex>
 
+#include <stdarg.h>
 #include <sys/reboot.h>
+#include <linux/reboot.h>
 
-// prefix/buttons/index/action/clicks
+#define CONFIG_FILE "/sdcard/wink_manager.ini"
+
+// prefix/buttons/index/action/clicks, index 2 is both buttons pressed together
 #define MQTT_BUTTON_TOPIC_FORMAT "%s/buttons/%d/%s/%d"
 #define MQTT_BUTTON_CLICK_ACTION "click"
 #define MQTT_BUTTON_HELD_ACTION "held"
 #define MQTT_BUTTON_RELEASED_ACTION "released"
+#define MQTT_BUTTON_HELD_2_ACTION "held_2"
+#define MQTT_BUTTON_HELD_3_ACTION "held_3"
 
 #define MQTT_RELAY_STATE_TOPIC_FORMAT "%s/relays/%d/state"
 #define MQTT_TEMPERATURE_TOPIC_FORMAT "%s/sensors/temperature"
 #define MQTT_HUMIDITY_TOPIC_FORMAT "%s/sensors/humidity"
 #define MQTT_SCREEN_STATE_TOPIC_FORMAT "%s/screen/state"
 #define MQTT_PROXIMITY_TRIGGER_TOPIC_FORMAT "%s/proximity/trigger"
+#define MQTT_LOG_DUMP_TOPIC_FORMAT "%s/log/dump"
+#define MQTT_LATENCY_TOPIC_FORMAT "%s/diagnostics/latency"
+#define MQTT_INPUT_STATS_TOPIC_FORMAT "%s/diagnostics/input"
+
+// button topics are pre-built up to this many clicks, longer runs are formatted on demand
+#define MQTT_MAX_CLICK_TOPICS 5
 
 void _onConnectFailure(void* context, MQTTAsync_failureData* response);
+void _onStateDelivered(void* context, MQTTAsync_successData* response);
+void _onButtonWritten(void* context, MQTTAsync_successData* response);
 void _onConnected(void* context, char* cause);
 int _messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message);
 int _configHandler(void* user, const char* section, const char* name, const char* value);
@@ -36,6 +61,104 @@ enum RelayFlags {
   RELAY_FLAG_TOGGLE_OPPOSITE = 1 << 5,
 };
 
+// held tiers after the first follow BUTTON_ACTION_RELEASED, up to MAX_HELD_TIERS
+enum ButtonAction {
+  BUTTON_ACTION_CLICK,
+  BUTTON_ACTION_HELD,
+  BUTTON_ACTION_RELEASED,
+  BUTTON_ACTION_HELD_2,
+  BUTTON_ACTION_HELD_3,
+  BUTTON_ACTION_COUNT
+};
+
+static const char* const s_buttonActionNames[BUTTON_ACTION_COUNT] = {
+  MQTT_BUTTON_CLICK_ACTION, MQTT_BUTTON_HELD_ACTION, MQTT_BUTTON_RELEASED_ACTION,
+  MQTT_BUTTON_HELD_2_ACTION, MQTT_BUTTON_HELD_3_ACTION
+};
+
+// Outgoing topics, built and validated once after the config is read so the
+// publish path only hands pointers to MQTTAsync_sendStatic
+struct Topics {
+  std::string buttons[GESTURE_BUTTON_COUNT][BUTTON_ACTION_COUNT][MQTT_MAX_CLICK_TOPICS];
+  std::string relayState[2];
+  std::string temperature;
+  std::string humidity;
+  std::string screenState;
+  std::string proximityTrigger;
+  std::string logDump;
+  std::string latency;
+  std::string inputStats;
+};
+
+// Where the buttons, relays and sensors are read from, see the hardware ini key
+enum HardwareBackend {
+  HARDWARE_SYSFS,
+  HARDWARE_GPIOCHIP,
+  HARDWARE_SIMULATED
+};
+
+// Retained state topics that go through the coalescing stage, see publishState()
+enum StateTopic {
+  STATE_RELAY_0,
+  STATE_RELAY_1,
+  STATE_TEMPERATURE,
+  STATE_HUMIDITY,
+  STATE_SCREEN,
+  STATE_TOPIC_COUNT
+};
+
+class WinkRelayManager;
+
+// longest retained state payload, with its terminator
+#define STATE_PAYLOAD_SIZE 16
+
+// Each state is the onSuccess context of its own publishes, so deliveries are matched
+// even when paho reports them without a topic (after a partial write)
+struct RetainedState {
+  WinkRelayManager* manager = nullptr;
+  const std::string* topic = nullptr;
+  // latest value waiting for the next flush, written on the looper thread only
+  const char* pending = nullptr;
+  char pendingBuffer[STATE_PAYLOAD_SIZE] = {0};
+  bool dirty = false;
+  // last value handed to the client and how many sends it has confirmed, guarded by m_stateLock
+  char sent[STATE_PAYLOAD_SIZE] = {0};
+  int sentCount = 0;
+  int deliveredCount = 0;
+};
+
+// Button events held back while the broker is unreachable, replayed in order on reconnect
+#define OFFLINE_EVENT_CAPACITY 64
+#define OFFLINE_DRAIN_BATCH 8
+#define OFFLINE_DRAIN_INTERVAL std::chrono::milliseconds(50)
+
+#define MQTT_BATCH_BYTES 1400
+#define MQTT_BATCH_COUNT 32
+
+// messages the async logger can hold before callers block, must be a power of 2
+#define ASYNC_LOG_QUEUE_SIZE 256
+
+// debug records kept in memory for command/dump_log, and the bytes kept of each
+#define FLIGHT_RECORDER_RECORDS 256
+#define FLIGHT_RECORDER_RECORD_SIZE 256
+
+// button publishes whose edge to wire latency can be in flight at once
+#define LATENCY_SAMPLE_SLOTS 64
+
+// Edge time of a button publish handed to paho as its onSuccess context. Slots are
+// reused round robin, so a publish queued behind LATENCY_SAMPLE_SLOTS others reports
+// a later edge than its own.
+struct LatencySample {
+  LatencyHistogram* latency = nullptr;
+  std::atomic<std::chrono::steady_clock::rep> edge{0};
+};
+
+struct OfflineEvent {
+  int button;
+  ButtonAction action;
+  int count;
+};
+
 struct Config {
   std::string mqttClientId = "Relay";
   std::string mqttUsername;
@@ -45,22 +168,49 @@ struct Config {
   bool hideStatusBar = true;
   bool sendScreenState = false;
   bool sendProximityTrigger = false;
-  short relayFlags[2] = { RELAY_FLAG_SEND_CLICK | RELAY_FLAG_SEND_HELD, RELAY_FLAG_SEND_CLICK | RELAY_FLAG_SEND_HELD };
+  int statePublishInterval = 250; // ms between flushes of retained state
+  int mqttBatchDelay = 0; // ms queued publishes may wait to share a socket write
+  bool asyncLog = false;
+  bool debug = false;
+  HardwareBackend hardware = HARDWARE_SYSFS;
+  int buttonDebounce = 10; // ms, gpiochip only
+  std::string hardwareScript;
+  // upper, lower and the chord of both; chords are only decoded when their flags are set
+  short relayFlags[GESTURE_BUTTON_COUNT] = { RELAY_FLAG_SEND_CLICK | RELAY_FLAG_SEND_HELD, RELAY_FLAG_SEND_CLICK | RELAY_FLAG_SEND_HELD, RELAY_FLAG_NONE };
 };
 
 class WinkRelayManager : public RelayCallbacks {
 private:
-  using MessageFunction = std::function<void(MQTTAsync_message* msg)>;
+  using MessageRouter = TopicRouter<MQTTAsync_message*>;
   WinkRelay m_relay;
   Config m_config;
+  Topics m_topics;
+  RetainedState m_states[STATE_TOPIC_COUNT];
+  std::mutex m_stateLock;
+  bool m_stateFlushScheduled = false;
+  // ring of OfflineEvent, only touched on the looper thread
+  OfflineEvent m_offlineEvents[OFFLINE_EVENT_CAPACITY];
+  size_t m_offlineHead = 0;
+  size_t m_offlineSize = 0;
+  size_t m_offlineBuffered = 0;
+  size_t m_offlineDropped = 0;
+  bool m_offlineDraining = false;
+  std::chrono::steady_clock::time_point m_lastStateFlush;
   MQTTAsync m_mqttClient;
-  std::map<std::string, MessageFunction> m_messageCallbacks;
+  MessageRouter m_messageRouter;
   std::shared_ptr<spdlog::logger> log;
+  std::shared_ptr<spdlog::sinks::ring_sink> m_flightRecorder;
+  // gpio edge to button PUBLISH written, the relay command path is in m_relay.relayLatency()
+  LatencyHistogram m_buttonLatency;
+  LatencySample m_latencySamples[LATENCY_SAMPLE_SLOTS];
+  size_t m_nextLatencySample = 0;
+  // when the message being dispatched arrived, MQTT thread only
+  std::chrono::steady_clock::time_point m_messageReceived;
 
 public:
-  void buttonClicked(int button, int count) {
-    log->debug("button {} clicked. {} clicks", button, count);
-    if ((m_config.relayFlags[button] & RELAY_FLAG_TOGGLE) && count == 1) {
+  void buttonClicked(int button, int count, std::chrono::steady_clock::time_point edge) {
+    log->debug("button {} clicked. {} clicks, scheduler heap allocations {}", button, count, m_relay.scheduler().GetHeapAllocationCount());
+    if ((m_config.relayFlags[button] & RELAY_FLAG_TOGGLE) && count == 1 && button != BUTTON_CHORD) {
       if (m_config.relayFlags[button] & RELAY_FLAG_TOGGLE_OPPOSITE) {
         m_relay.toggleRelay(!button);
       } else {
@@ -71,67 +221,52 @@ public:
       m_relay.toggleTouchInput();
     }
     if (m_config.relayFlags[button] & RELAY_FLAG_SEND_CLICK) {
-      char topic[256] = {0};
-      sprintf(topic, MQTT_BUTTON_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str(), button, MQTT_BUTTON_CLICK_ACTION, count);
-      sendPayload(topic, "ON");
+      sendButtonAction(button, BUTTON_ACTION_CLICK, count, edge);
     }
   }
-  void buttonHeld(int button, int count) {
-    log->debug("button {} held. {} clicks", button, count);
+  void buttonHeld(int button, int count, int tier, std::chrono::steady_clock::time_point edge) {
+    log->debug("button {} held. {} clicks, tier {}", button, count, tier);
     if (m_config.relayFlags[button] & RELAY_FLAG_SEND_HELD) {
-      char topic[256] = {0};
-      sprintf(topic, MQTT_BUTTON_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str(), button, MQTT_BUTTON_HELD_ACTION, count);
-      sendPayload(topic, "ON");
+      ButtonAction action = tier <= 1 ? BUTTON_ACTION_HELD : (ButtonAction)(BUTTON_ACTION_HELD_2 + tier - 2);
+      sendButtonAction(button, action, count, edge);
     }
   }
-  void buttonReleased(int button, int count) {
+  void buttonReleased(int button, int count, std::chrono::steady_clock::time_point edge) {
     log->debug("button {} released. {} clicks", button, count);
     if (m_config.relayFlags[button] & RELAY_FLAG_SEND_RELEASE) {
-      char topic[256] = {0};
-      sprintf(topic, MQTT_BUTTON_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str(), button, MQTT_BUTTON_RELEASED_ACTION, count);
-      sendPayload(topic, "ON");
+      sendButtonAction(button, BUTTON_ACTION_RELEASED, count, edge);
     }
   }
 
   void relayStateChanged(int relay, bool state) {
-    char topic[256] = {0};
-    sprintf(topic, MQTT_RELAY_STATE_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str(), relay);
-    sendPayload(topic, state ? "ON" : "OFF", true);
+    publishState(relay == 0 ? STATE_RELAY_0 : STATE_RELAY_1, state ? "ON" : "OFF", true);
   }
 
   void temperatureChanged(float tempC) {
-    char topic[256] = {0};
-    sprintf(topic, MQTT_TEMPERATURE_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str());
-    char payload[10] = {0};
-    sprintf(payload, "%f", tempC);
-    sendPayload(topic, payload, true);
+    char payload[STATE_PAYLOAD_SIZE] = {0};
+    snprintf(payload, sizeof(payload), "%.2f", tempC);
+    publishState(STATE_TEMPERATURE, payload);
   }
 
   void humidityChanged(float humidity) {
-    char topic[256] = {0};
-    sprintf(topic, MQTT_HUMIDITY_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str());
-    char payload[10] = {0};
-    sprintf(payload, "%f", humidity);
-    sendPayload(topic, payload, true);
+    char payload[STATE_PAYLOAD_SIZE] = {0};
+    snprintf(payload, sizeof(payload), "%.2f", humidity);
+    publishState(STATE_HUMIDITY, payload);
   }
 
   void proximityTriggered(int p) {
     log->debug("Proximity triggered {}", p);
     if (m_config.sendProximityTrigger) {
-        char topic[256] = {0};
-        sprintf(topic, MQTT_PROXIMITY_TRIGGER_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str());
         char payload[10] = {0};
         sprintf(payload, "%d", p);
-        sendPayload(topic, payload, false);
+        publish(m_topics.proximityTrigger, payload, false);
     }
   }
 
   void screenStateChanged(bool state) {
     log->debug("Screen state changed {}", state);
     if (m_config.sendScreenState) {
-        char topic[256] = {0};
-        sprintf(topic, MQTT_SCREEN_STATE_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str());
-        sendPayload(topic, state ? "ON" : "OFF", true);
+        publishState(STATE_SCREEN, state ? "ON" : "OFF", true);
     }
   }
 
@@ -141,17 +276,32 @@ public:
 
   void onConnected(char* cause) {
     log->info("Successful connection");
-    int topicCount = m_messageCallbacks.size();
+    auto const& filters = m_messageRouter.filters();
+    int topicCount = filters.size();
     char* topics[topicCount];
     int qos[topicCount];
     int i=0;
 
-    for (auto it = m_messageCallbacks.begin(); it != m_messageCallbacks.end(); ++it) {
-      topics[i] = (char*)(it->first.c_str());
+    for (auto it = filters.begin(); it != filters.end(); ++it) {
+      topics[i] = (char*)(it->c_str());
       qos[i++] = 0;
     }
     MQTTAsync_subscribeMany(m_mqttClient, topicCount, topics, qos, nullptr);
+    {
+      // sends that never got confirmed may not have reached the broker, forget them so resetState() resends
+      std::lock_guard<std::mutex> guard(m_stateLock);
+      for (auto& s : m_states) {
+        if (s.deliveredCount != s.sentCount) {
+          s.sent[0] = 0;
+          s.sentCount = s.deliveredCount = 0;
+        }
+      }
+    }
     m_relay.resetState(); // trigger fresh state events on next loop
+    m_relay.post([this] () {
+      flushStates(); // states that could not be sent while offline, already compacted to the latest value
+      drainOfflineEvents();
+    });
   }
 
   void onConnectFailure(MQTTAsync_failureData* response) {
@@ -159,23 +309,215 @@ public:
   }
 
   void messageArrived(char* topicName, int topicLen, MQTTAsync_message* message) {
+    m_messageReceived = std::chrono::steady_clock::now();
     log->debug("Received message on topic [{}] : {:.{}}", topicName, (const char*)message->payload, message->payloadlen); 
-    auto it = m_messageCallbacks.find(topicName);
-    if (it != m_messageCallbacks.end()) {
-      it->second(message);
-    }
+    m_messageRouter.dispatch(topicName, topicLen, message);
   }
   
-  void sendPayload(const char* topic, const char* payload, bool retained = false) {
-    // check if connected?
+  // topic must live in m_topics; payload is copied unless MQTTASYNC_STATIC_PAYLOAD is passed for a literal
+  void publish(const std::string& topic, const char* payload, bool retained = false, int flags = 0) {
     log->debug("Sending \"{}\" on [{}]", payload, topic);
     int rc;
-    if ((rc = MQTTAsync_send(m_mqttClient, topic, strlen(payload), (void*)payload, 0, retained, NULL)) != MQTTASYNC_SUCCESS)
+    if ((rc = MQTTAsync_sendStatic(m_mqttClient, topic.c_str(), strlen(payload), payload, 0, retained,
+                                   MQTTASYNC_STATIC_TOPIC | flags, NULL)) != MQTTASYNC_SUCCESS)
     {
       log->error("Failed to send payload, return code {}", rc);
     }
   }
 
+  // Queues the latest value of a retained state topic. Values equal to the last
+  // delivered one are dropped, and bursts are flushed at most once per statePublishInterval
+  // so only the final value of a burst goes out. literal payloads are sent without copying.
+  void publishState(StateTopic id, const char* payload, bool literal = false) {
+    RetainedState& s = m_states[id];
+    {
+      std::lock_guard<std::mutex> guard(m_stateLock);
+      if (s.sentCount == s.deliveredCount && strcmp(s.sent, payload) == 0) {
+        s.dirty = false;
+        return;
+      }
+    }
+    if (literal) {
+      s.pending = payload;
+    } else {
+      strncpy(s.pendingBuffer, payload, sizeof(s.pendingBuffer) - 1);
+      s.pending = s.pendingBuffer;
+    }
+    s.dirty = true;
+
+    if (m_stateFlushScheduled) {
+      return;
+    }
+    auto interval = std::chrono::milliseconds(m_config.statePublishInterval);
+    auto wait = m_lastStateFlush + interval - std::chrono::steady_clock::now();
+    if (wait <= std::chrono::steady_clock::duration::zero()) {
+      flushStates();
+    } else {
+      m_stateFlushScheduled = true;
+      m_relay.scheduler().Schedule(wait, [this] (tsc::TaskContext) {
+        m_stateFlushScheduled = false;
+        flushStates();
+      });
+    }
+  }
+
+  void flushStates() {
+    m_lastStateFlush = std::chrono::steady_clock::now();
+    for (auto& s : m_states) {
+      if (!s.dirty) {
+        continue;
+      }
+      MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+      opts.onSuccess = _onStateDelivered;
+      opts.context = &s;
+      int flags = MQTTASYNC_STATIC_TOPIC | (s.pending != s.pendingBuffer ? MQTTASYNC_STATIC_PAYLOAD : 0);
+      log->debug("Sending \"{}\" on [{}]", s.pending, *s.topic);
+      int rc;
+      if ((rc = MQTTAsync_sendStatic(m_mqttClient, s.topic->c_str(), strlen(s.pending), s.pending, 0, true, flags, &opts)) != MQTTASYNC_SUCCESS) {
+        log->error("Failed to send payload, return code {}", rc);
+        continue;
+      }
+      s.dirty = false;
+      std::lock_guard<std::mutex> guard(m_stateLock);
+      strncpy(s.sent, s.pending, sizeof(s.sent) - 1);
+      s.sentCount++;
+    }
+  }
+
+  // called on the MQTT thread once a state publish has been written out, in send order
+  void onStateDelivered(RetainedState& s) {
+    std::lock_guard<std::mutex> guard(m_stateLock);
+    if (s.deliveredCount < s.sentCount) {
+      s.deliveredCount++;
+    }
+  }
+
+  void sendButtonAction(int button, ButtonAction action, int count, std::chrono::steady_clock::time_point edge) {
+    // keep order behind anything still waiting to be replayed
+    if (m_offlineSize > 0 || trySendButtonAction(button, action, count, edge) == MQTTASYNC_DISCONNECTED) {
+      bufferOfflineEvent(OfflineEvent{button, action, count});
+    }
+  }
+
+  // edge is empty for replayed events, which aren't measured
+  int trySendButtonAction(int button, ButtonAction action, int count,
+                          std::chrono::steady_clock::time_point edge = std::chrono::steady_clock::time_point()) {
+    const char* topic;
+    char buffer[256] = {0};
+    int flags = MQTTASYNC_STATIC_PAYLOAD;
+    if (count >= 1 && count <= MQTT_MAX_CLICK_TOPICS) {
+      topic = m_topics.buttons[button][action][count - 1].c_str();
+      flags |= MQTTASYNC_STATIC_TOPIC;
+    } else {
+      sprintf(buffer, MQTT_BUTTON_TOPIC_FORMAT, m_config.mqttTopicPrefix.c_str(), button, s_buttonActionNames[action], count);
+      topic = buffer;
+    }
+    MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+    if (edge != std::chrono::steady_clock::time_point()) {
+      LatencySample& sample = m_latencySamples[m_nextLatencySample++ % LATENCY_SAMPLE_SLOTS];
+      sample.latency = &m_buttonLatency;
+      sample.edge = edge.time_since_epoch().count();
+      opts.onSuccess = _onButtonWritten;
+      opts.context = &sample;
+    }
+    log->debug("Sending \"ON\" on [{}]", topic);
+    int rc = MQTTAsync_sendStatic(m_mqttClient, topic, 2, "ON", 0, false, flags, &opts);
+    if (rc != MQTTASYNC_SUCCESS && rc != MQTTASYNC_DISCONNECTED) {
+      log->error("Failed to send payload, return code {}", rc);
+    }
+    return rc;
+  }
+
+  void bufferOfflineEvent(OfflineEvent const& event) {
+    if (m_offlineSize == OFFLINE_EVENT_CAPACITY) {
+      // drop the oldest so the most recent presses survive
+      m_offlineHead = (m_offlineHead + 1) % OFFLINE_EVENT_CAPACITY;
+      m_offlineSize--;
+      m_offlineDropped++;
+    }
+    m_offlineEvents[(m_offlineHead + m_offlineSize) % OFFLINE_EVENT_CAPACITY] = event;
+    m_offlineSize++;
+    m_offlineBuffered++;
+    log->debug("Buffered offline event, {} pending, {} buffered, {} dropped", m_offlineSize, m_offlineBuffered, m_offlineDropped);
+  }
+
+  // Replays buffered events in batches of OFFLINE_DRAIN_BATCH so a reconnect does not flood the broker
+  void drainOfflineEvents() {
+    if (m_offlineDraining || m_offlineSize == 0) {
+      return;
+    }
+    log->info("Replaying {} offline events ({} buffered, {} dropped in total)", m_offlineSize, m_offlineBuffered, m_offlineDropped);
+    m_offlineDraining = true;
+    m_relay.scheduler().Schedule(std::chrono::milliseconds::zero(), [this] (tsc::TaskContext c) {
+      for (int i = 0; i < OFFLINE_DRAIN_BATCH && m_offlineSize > 0; ++i) {
+        OfflineEvent const& event = m_offlineEvents[m_offlineHead];
+        if (trySendButtonAction(event.button, event.action, event.count) == MQTTASYNC_DISCONNECTED) {
+          // lost the connection again, the next onConnected picks up from here
+          m_offlineDraining = false;
+          return;
+        }
+        m_offlineHead = (m_offlineHead + 1) % OFFLINE_EVENT_CAPACITY;
+        m_offlineSize--;
+      }
+      if (m_offlineSize > 0) {
+        c.Repeat(OFFLINE_DRAIN_INTERVAL);
+      } else {
+        m_offlineDraining = false;
+      }
+    });
+  }
+
+  // Logs the reason and exits. exit() doesn't destroy the logger, so with log_async the
+  // message would still be queued when the worker dies
+  template<typename... Args>
+  [[noreturn]] void fatal(const char* fmt, const Args&... args) {
+    log->error(fmt, args...);
+    log->flush();
+    exit(EXIT_FAILURE);
+  }
+
+  std::string formatTopic(const char* format, ...) {
+    char topic[256] = {0};
+    va_list args;
+    va_start(args, format);
+    vsnprintf(topic, sizeof(topic), format, args);
+    va_end(args);
+    if (MQTTAsync_checkTopic(topic) != MQTTASYNC_SUCCESS) {
+      fatal("Invalid topic [{}]", topic);
+    }
+    return topic;
+  }
+
+  void buildTopics() {
+    const char* prefix = m_config.mqttTopicPrefix.c_str();
+    for (int button = 0; button < GESTURE_BUTTON_COUNT; ++button) {
+      for (int action = 0; action < BUTTON_ACTION_COUNT; ++action) {
+        for (int clicks = 1; clicks <= MQTT_MAX_CLICK_TOPICS; ++clicks) {
+          m_topics.buttons[button][action][clicks - 1] = formatTopic(MQTT_BUTTON_TOPIC_FORMAT, prefix, button, s_buttonActionNames[action], clicks);
+        }
+      }
+    }
+    for (int relay = 0; relay < 2; ++relay) {
+      m_topics.relayState[relay] = formatTopic(MQTT_RELAY_STATE_TOPIC_FORMAT, prefix, relay);
+    }
+    m_topics.temperature = formatTopic(MQTT_TEMPERATURE_TOPIC_FORMAT, prefix);
+    m_topics.humidity = formatTopic(MQTT_HUMIDITY_TOPIC_FORMAT, prefix);
+    m_topics.screenState = formatTopic(MQTT_SCREEN_STATE_TOPIC_FORMAT, prefix);
+    m_topics.proximityTrigger = formatTopic(MQTT_PROXIMITY_TRIGGER_TOPIC_FORMAT, prefix);
+    m_topics.logDump = formatTopic(MQTT_LOG_DUMP_TOPIC_FORMAT, prefix);
+    m_topics.latency = formatTopic(MQTT_LATENCY_TOPIC_FORMAT, prefix);
+    m_topics.inputStats = formatTopic(MQTT_INPUT_STATS_TOPIC_FORMAT, prefix);
+
+    m_states[STATE_RELAY_0].topic = &m_topics.relayState[0];
+    m_states[STATE_RELAY_1].topic = &m_topics.relayState[1];
+    m_states[STATE_TEMPERATURE].topic = &m_topics.temperature;
+    m_states[STATE_HUMIDITY].topic = &m_topics.humidity;
+    m_states[STATE_SCREEN].topic = &m_topics.screenState;
+    for (auto& s : m_states) {
+      s.manager = this;
+    }
+  }
+
   bool processStatePayload(const char* payload, int len, bool& state) {
     if (strncmp(payload, "1", len) == 0 || strncasecmp(payload, "ON", len) == 0 || strncasecmp(payload, "true", len) == 0) {
       state = true;
@@ -226,6 +568,29 @@ public:
       m_config.relayFlags[0] = atoi(value);
     } else if (strcmp(name, "relay_lower_flags") == 0) {
       m_config.relayFlags[1] = atoi(value);
+    } else if (strcmp(name, "chord_flags") == 0) {
+      m_config.relayFlags[BUTTON_CHORD] = atoi(value);
+    } else if (strcmp(name, "button_click_window") == 0) {
+      int t = atoi(value);
+      if (t >= 0) {
+        m_relay.gestureTimings().clickWindow = std::chrono::milliseconds(t);
+      }
+    } else if (strcmp(name, "button_held_time") == 0) {
+      parseHeldTiers(value);
+    } else if (strcmp(name, "button_held_repeat") == 0) {
+      int t = atoi(value);
+      if (t >= 0) {
+        m_relay.gestureTimings().heldRepeat = std::chrono::milliseconds(t);
+      }
+    } else if (strcmp(name, "button_debounce") == 0) {
+      int t = atoi(value);
+      if (t >= 0) {
+        m_config.buttonDebounce = t;
+      }
+    } else if (strcmp(name, "relay_upper_max_clicks") == 0) {
+      m_relay.setMaxClicks(0, atoi(value));
+    } else if (strcmp(name, "relay_lower_max_clicks") == 0) {
+      m_relay.setMaxClicks(1, atoi(value));
     } else if (strcmp(name, "initial_relay_upper_state") == 0) {
       bool state;
       if (processStatePayload(value, strlen(value), state)) {
@@ -239,16 +604,41 @@ public:
     } else if (strcmp(name, "log_file") == 0) {
       log = spdlog::rotating_logger_mt("wink_manager", value, 1024*1024, 1);
       log->flush_on(spdlog::level::info);
+    } else if (strcmp(name, "log_async") == 0) {
+      bool state = false;
+      processStatePayload(value, strlen(value), state);
+      m_config.asyncLog = state;
     } else if (strcmp(name, "send_proximity_trigger") == 0) {
       bool state = false;
       processStatePayload(value, strlen(value), state);
       m_config.sendProximityTrigger = state;
+    } else if (strcmp(name, "state_publish_interval") == 0) {
+      int t = atoi(value);
+      if (t >= 0) {
+        m_config.statePublishInterval = t;
+      }
+    } else if (strcmp(name, "mqtt_batch_delay") == 0) {
+      int t = atoi(value);
+      if (t >= 0) {
+        m_config.mqttBatchDelay = t;
+      }
+    } else if (strcmp(name, "hardware") == 0) {
+      if (strcmp(value, "simulated") == 0) {
+        m_config.hardware = HARDWARE_SIMULATED;
+      } else if (strcmp(value, "gpiochip") == 0) {
+        m_config.hardware = HARDWARE_GPIOCHIP;
+      } else {
+        m_config.hardware = HARDWARE_SYSFS;
+      }
+    } else if (strcmp(name, "hardware_script") == 0) {
+      m_config.hardwareScript = value;
     } else if (strcmp(name, "send_screen_state") == 0) {
       bool state = false;
       processStatePayload(value, strlen(value), state);
       m_config.sendScreenState = state;
     } else if (strcmp(name, "debug") == 0) {
       if (strcmp(value, "true") == 0) {
+        m_config.debug = true;
         spdlog::set_level(spdlog::level::debug);
         log->flush_on(spdlog::level::debug);
         log->info("Debug logging enabled");
@@ -257,10 +647,61 @@ public:
     return 1;
   }
 
-  void handleRelayMessage(int relay, MQTTAsync_message* msg) {
+  // Comma separated, increasing held durations in ms, one per tier
+  void parseHeldTiers(const char* value) {
+    std::chrono::milliseconds tiers[MAX_HELD_TIERS];
+    int count = 0;
+    char* end;
+    for (const char* p = value; *p && count < MAX_HELD_TIERS; p = *end ? end + 1 : end) {
+      long t = strtol(p, &end, 10);
+      if (end == p || t <= 0 || (count > 0 && t <= tiers[count - 1].count())) {
+        log->error("Invalid button_held_time {}", value);
+        return;
+      }
+      tiers[count++] = std::chrono::milliseconds(t);
+    }
+    for (int i = 0; i < MAX_HELD_TIERS; ++i) {
+      m_relay.gestureTimings().heldTiers[i] = i < count ? tiers[i] : std::chrono::milliseconds::zero();
+    }
+  }
+
+  // Rebuild the logger over the configured sinks plus the flight recorder. The logger always
+  // runs at debug so the recorder sees every record, the configured sinks stay at info unless
+  // debug is set. With log_async the records are handed to a worker thread, so events on the
+  // looper don't wait for formatting and writing. The worker blocks while the queue is empty
+  // (SPDLOG_ASYNC_BLOCKING_WAIT) instead of polling.
+  void setupLogger() {
+    auto level = m_config.debug ? spdlog::level::debug : spdlog::level::info;
+    std::vector<spdlog::sink_ptr> sinks;
+    for (auto const& sink : log->sinks()) {
+      sink->set_level(level);
+      sinks.push_back(sink);
+    }
+    m_flightRecorder = std::make_shared<spdlog::sinks::ring_sink>(FLIGHT_RECORDER_RECORDS, FLIGHT_RECORDER_RECORD_SIZE);
+    sinks.push_back(m_flightRecorder);
+
+    std::shared_ptr<spdlog::logger> logger;
+    if (m_config.asyncLog) {
+      logger = std::make_shared<spdlog::async_logger>(log->name(), sinks.begin(), sinks.end(), ASYNC_LOG_QUEUE_SIZE);
+    } else {
+      logger = std::make_shared<spdlog::logger>(log->name(), sinks.begin(), sinks.end());
+    }
+    logger->set_level(spdlog::level::debug);
+    logger->flush_on(level);
+    log = logger;
+    if (m_config.asyncLog) {
+      log->info("Async logging enabled");
+    }
+  }
+
+  void handleRelayMessage(TopicMatch const& match, MQTTAsync_message* msg) {
+    int relay = match.wildcards[0].toInt();
+    if (relay < 0 || relay > 1) {
+      return;
+    }
     bool state;
     if (processStatePayload((const char*)msg->payload, msg->payloadlen, state)) {
-      m_relay.setRelay(relay, state);
+      m_relay.setRelay(relay, state, m_messageReceived);
     }
   }
 
@@ -272,30 +713,137 @@ public:
   }
 
   void handleRebootMessage(MQTTAsync_message* msg) {
+    logLatency();
     reboot(LINUX_REBOOT_CMD_RESTART);
   }
 
   void handleExitMessage(MQTTAsync_message* msg) {
+    logLatency();
     exit(EXIT_SUCCESS);
   }
 
-  void start() {
+  void handleLatencyMessage(MQTTAsync_message* msg) {
+    publish(m_topics.latency, latencyReport().c_str());
+  }
+
+  // {"button":{...},"relay":{...}} with count, p50_us, p99_us and max_us for each path
+  std::string latencyReport() {
+    auto button = m_buttonLatency.summary();
+    auto relay = m_relay.relayLatency().summary();
+    char report[256] = {0};
+    snprintf(report, sizeof(report),
+             "{\"button\":{\"count\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu},"
+             "\"relay\":{\"count\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu}}",
+             (unsigned long long)button.count, (unsigned long long)button.p50, (unsigned long long)button.p99, (unsigned long long)button.max,
+             (unsigned long long)relay.count, (unsigned long long)relay.p50, (unsigned long long)relay.p99, (unsigned long long)relay.max);
+    return report;
+  }
+
+  void handleInputStatsMessage(MQTTAsync_message* msg) {
+    publish(m_topics.inputStats, inputStatsReport().c_str());
+  }
+
+  // {"touch":{...},"proximity":{...},...} with the reads, events and most events in one read of each input device
+  std::string inputStatsReport() {
+    static const char* names[INPUT_DEVICE_COUNT] = { "touch", "proximity", "ambient_light", "ambient_light_ir" };
+    std::string report = "{";
+    for (int i = 0; i < INPUT_DEVICE_COUNT; ++i) {
+      auto stats = m_relay.inputStats((InputDevice)i).summary();
+      char device[128] = {0};
+      snprintf(device, sizeof(device), "%s\"%s\":{\"reads\":%llu,\"events\":%llu,\"max_per_read\":%llu}",
+               i ? "," : "", names[i], (unsigned long long)stats.reads, (unsigned long long)stats.events, (unsigned long long)stats.max);
+      report += device;
+    }
+    report += "}";
+    return report;
+  }
+
+  void logLatency() {
+    log->info("Latency {}", latencyReport());
+    log->info("Input reads {}", inputStatsReport());
+    log->flush();
+  }
+
+  // Publishes the last N flight recorder records (all of them for an empty payload) as one message
+  void handleDumpLogMessage(MQTTAsync_message* msg) {
+    std::string payload((const char*)msg->payload, msg->payloadlen);
+    int limit = atoi(payload.c_str());
+    auto records = m_flightRecorder->last_formatted(limit > 0 ? limit : 0);
+    log->info("Dumping {} log records, {} dropped", records.size(), m_flightRecorder->dropped());
+    std::string dump;
+    for (auto const& record : records) {
+      dump += record;
+    }
+    // not through publish(), which would log the whole dump back into the recorder
+    int rc;
+    if ((rc = MQTTAsync_sendStatic(m_mqttClient, m_topics.logDump.c_str(), dump.size(), dump.c_str(), 0, 0,
+                                   MQTTASYNC_STATIC_TOPIC, NULL)) != MQTTASYNC_SUCCESS)
+    {
+      log->error("Failed to send log dump, return code {}", rc);
+    }
+  }
+
+  // A fake device tree for running on a host, optionally driven by a script
+  void setupSimulatedHardware() {
+    std::unique_ptr<SimulatedHardware> hardware(new SimulatedHardware());
+    log->info("Simulating hardware under {}", hardware->root());
+    if (!m_config.hardwareScript.empty() && !hardware->runScript(m_config.hardwareScript)) {
+      fatal("Can't load hardware script {}", m_config.hardwareScript);
+    }
+    m_relay.setHardware(std::move(hardware));
+  }
+
+  // Buttons on the gpio character device, the rest stays on sysfs
+  void setupGpioChipHardware() {
+#ifdef GPIO_GET_LINEEVENT_IOCTL
+    std::unique_ptr<GpioChipHardware> hardware(new GpioChipHardware(std::chrono::milliseconds(m_config.buttonDebounce)));
+    if (hardware->usingChip()) {
+      log->info("Reading buttons from {} with {}ms debounce", BUTTON_GPIO_CHIP, m_config.buttonDebounce);
+    } else {
+      log->warn("Can't request button lines on {} ({}), using sysfs", BUTTON_GPIO_CHIP, strerror(hardware->error()));
+    }
+    m_relay.setHardware(std::move(hardware));
+#else
+    log->warn("Built without gpio character device support, using sysfs");
+#endif
+  }
+
+  void start(const char* configFile) {
+#ifdef __ANDROID__
     log = spdlog::android_logger("log", "wink_manager");
+#else
+    log = spdlog::stdout_logger_mt("log");
+#endif
     log->flush_on(spdlog::level::info);
     log->info("Wink Manager started");
     // parse config
-    if (ini_parse("/sdcard/wink_manager.ini", _configHandler, this) < 0) {
-      log->error("Can't load /sdcard/wink_manager.ini");
+    if (ini_parse(configFile, _configHandler, this) < 0) {
+      log->error("Can't load {}", configFile);
       exit(EXIT_FAILURE);
     }
+    setupLogger();
+    m_relay.setChords(m_config.relayFlags[BUTTON_CHORD] != RELAY_FLAG_NONE);
+    if (m_config.hardware == HARDWARE_SIMULATED) {
+      setupSimulatedHardware();
+    } else if (m_config.hardware == HARDWARE_GPIOCHIP) {
+      setupGpioChipHardware();
+    }
+    buildTopics();
 
-    m_messageCallbacks.emplace(m_config.mqttTopicPrefix + "/relays/0", std::bind(&WinkRelayManager::handleRelayMessage, this, 0, std::placeholders::_1));
-    m_messageCallbacks.emplace(m_config.mqttTopicPrefix + "/relays/1", std::bind(&WinkRelayManager::handleRelayMessage, this, 1, std::placeholders::_1));
-    m_messageCallbacks.emplace(m_config.mqttTopicPrefix + "/screen", std::bind(&WinkRelayManager::handleScreenMessage, this, std::placeholders::_1));
+    // inbound routes are relative to the topic prefix
+    m_messageRouter.setPrefix(m_config.mqttTopicPrefix);
+    m_messageRouter.add("relays/+", std::bind(&WinkRelayManager::handleRelayMessage, this, std::placeholders::_1, std::placeholders::_2));
+    m_messageRouter.add("screen", std::bind(&WinkRelayManager::handleScreenMessage, this, std::placeholders::_2));
 
     // commands
-    m_messageCallbacks.emplace(m_config.mqttTopicPrefix + "/command/reboot", std::bind(&WinkRelayManager::handleRebootMessage, this, std::placeholders::_1));
-    m_messageCallbacks.emplace(m_config.mqttTopicPrefix + "/command/exit", std::bind(&WinkRelayManager::handleExitMessage, this, std::placeholders::_1));
+    m_messageRouter.add("command/reboot", std::bind(&WinkRelayManager::handleRebootMessage, this, std::placeholders::_2));
+    m_messageRouter.add("command/exit", std::bind(&WinkRelayManager::handleExitMessage, this, std::placeholders::_2));
+    m_messageRouter.add("command/dump_log", std::bind(&WinkRelayManager::handleDumpLogMessage, this, std::placeholders::_2));
+    m_messageRouter.add("command/latency", std::bind(&WinkRelayManager::handleLatencyMessage, this, std::placeholders::_2));
+    m_messageRouter.add("command/input_stats", std::bind(&WinkRelayManager::handleInputStatsMessage, this, std::placeholders::_2));
+
+    // gather publishes queued back to back (resync, button bursts) into about one TCP segment per write
+    MQTTAsync_setWriteBatching(MQTT_BATCH_BYTES, MQTT_BATCH_COUNT, m_config.mqttBatchDelay);
 
     MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
     MQTTAsync_create(&m_mqttClient, m_config.mqttAddress.c_str(), m_config.mqttClientId.c_str(), MQTTCLIENT_PERSISTENCE_NONE, NULL);
@@ -317,8 +865,7 @@ public:
     int rc;
     if ((rc = MQTTAsync_connect(m_mqttClient, &conn_opts)) != MQTTASYNC_SUCCESS)
     {
-      log->error("Can't connect to {} - rcode {}", m_config.mqttAddress.c_str(), rc);
-      exit(EXIT_FAILURE);
+      fatal("Can't connect to {} - rcode {}", m_config.mqttAddress.c_str(), rc);
     }
 
     if (m_config.hideStatusBar) {
@@ -335,13 +882,14 @@ public:
 
     m_relay.setCallbacks(this);
     m_relay.start(false);
+    logLatency();
     MQTTAsync_destroy(&m_mqttClient);
   }
 };
 
-int main(void) {
+int main(int argc, char* argv[]) {
   WinkRelayManager manager;
-  manager.start();
+  manager.start(argc > 1 ? argv[1] : CONFIG_FILE);
   return 0;
 }
 
@@ -349,6 +897,16 @@ void _onConnectFailure(void* context, MQTTAsync_failureData* response) {
   ((WinkRelayManager*)context)->onConnectFailure(response);
 }
 
+void _onStateDelivered(void* context, MQTTAsync_successData* response) {
+  RetainedState* state = (RetainedState*)context;
+  state->manager->onStateDelivered(*state);
+}
+
+void _onButtonWritten(void* context, MQTTAsync_successData* response) {
+  LatencySample* sample = (LatencySample*)context;
+  sample->latency->recordSince(std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(sample->edge)));
+}
+
 void _onConnected(void* context, char* cause) {
   ((WinkRelayManager*)context)->onConnected(cause);
 }
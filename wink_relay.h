@@ -4,28 +4,25 @@
 #include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <memory>
 #include <thread>
 #include "TaskScheduler.hpp"
-#include "linux/input.h"
-
-#define BUTTON_0_GPIO "/sys/class/gpio/gpio8/"
-#define BUTTON_1_GPIO "/sys/class/gpio/gpio7/"
-#define RELAY_0_GPIO "/sys/class/gpio/gpio203/"
-#define RELAY_1_GPIO "/sys/class/gpio/gpio204/"
-
-#define SCREEN_STATE  "/sys/class/gpio/gpio30/value"
-#define SCREEN_INPUT_EVENTS "/dev/input/event0"
-#define AMBIENT_LIGHT_IR_INPUT_EVENTS "/dev/input/event1"
-#define AMBIENT_LIGHT_INPUT_EVENTS "/dev/input/event2"
-#define PROXIMITY_INPUT_EVENTS "/dev/input/event3"
-#define	TEMPERATURE_DATA "/sys/bus/i2c/devices/2-0040/temp1_input"
-#define HUMIDITY_DATA "/sys/bus/i2c/devices/2-0040/humidity1_input"
+#include "hardware.h"
+#include "button_gestures.h"
+#include "latency_histogram.h"
 
+// button is 0, 1 or BUTTON_CHORD. edge is when the gpio edge behind a button event was
+// seen, empty for repeated held events. tier counts up as a button stays held longer
 struct RelayCallbacks {
-  virtual void buttonClicked(int button, int clicks) = 0;
-  virtual void buttonHeld(int button, int clicks) = 0;
-  virtual void buttonReleased(int button, int clicks) = 0;
+  virtual void buttonClicked(int button, int clicks, std::chrono::steady_clock::time_point edge) = 0;
+  virtual void buttonHeld(int button, int clicks, int tier, std::chrono::steady_clock::time_point edge) = 0;
+  virtual void buttonReleased(int button, int clicks, std::chrono::steady_clock::time_point edge) = 0;
 
   virtual void relayStateChanged(int relay, bool state) = 0;
   virtual void temperatureChanged(float value) = 0;
@@ -36,31 +33,72 @@ struct RelayCallbacks {
   virtual ~RelayCallbacks() = default;
 };
 
-struct ButtonState {
-  bool held = false;
-  int clickCount = 0;
-};
+// button edges read from the hardware at once
+#define BUTTON_EDGE_BATCH 16
+// input events read per syscall, and reads of one device per looper wakeup. Events past
+// that wait for the next poll, after the buttons have been read
+#define INPUT_EVENT_BATCH 64
+#define INPUT_READS_PER_WAKEUP 4
+
+// Events returned by each read() of an input device, recorded on the looper thread and
+// safe to summarize from any thread
+class InputReadStats {
+public:
+  struct Summary {
+    uint64_t reads = 0;
+    uint64_t events = 0;
+    uint64_t max = 0;
+  };
+
+  void record(uint64_t events) {
+    m_reads.fetch_add(1, std::memory_order_relaxed);
+    m_events.fetch_add(events, std::memory_order_relaxed);
+    if (events > m_max.load(std::memory_order_relaxed)) {
+      m_max.store(events, std::memory_order_relaxed);
+    }
+  }
 
-int writeFile(const char* file, const char* data, int dataLen) {
-  int fd = open(file, O_WRONLY);
-  if (fd) {
-    return write(fd, data, dataLen);
-    close(fd);
+  Summary summary() const {
+    Summary s;
+    s.reads = m_reads.load(std::memory_order_relaxed);
+    s.events = m_events.load(std::memory_order_relaxed);
+    s.max = m_max.load(std::memory_order_relaxed);
+    return s;
   }
-  return -1;
-}
+
+private:
+  std::atomic<uint64_t> m_reads{0};
+  std::atomic<uint64_t> m_events{0};
+  std::atomic<uint64_t> m_max{0};
+};
 
 class WinkRelay {
 public:
   WinkRelay()
   : m_started(false), m_looper(), m_cb(nullptr), m_screenTimeout(20) {
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeFd < 0) {
+      // without it posted work would wait for the next unrelated deadline
+      perror("eventfd");
+      exit(EXIT_FAILURE);
+    }
     clearStates();
   }
 
+  // the looper must have returned, it polls m_wakeFd
+  ~WinkRelay() {
+    close(m_wakeFd);
+  }
+
   void setCallbacks(RelayCallbacks* cb) {
     m_cb = cb;
   }
 
+  // Must be called before start(), defaults to the device's sysfs/evdev nodes
+  void setHardware(std::unique_ptr<Hardware> hardware) {
+    m_hardware = std::move(hardware);
+  }
+
   void setScreenTimeout(int sec) {
     m_screenTimeout = std::chrono::seconds(sec);
   }
@@ -77,21 +115,41 @@ public:
     m_humidityThreshold = t;
   }
 
+  // Clicks after which a button reports its click on the release edge instead of
+  // waiting for more, 0 to always wait
+  void setMaxClicks(int button, int clicks) {
+    if (button == 0 || button == 1) {
+      m_gestures.setMaxClicks(button, clicks);
+    }
+  }
+
+  // Both buttons pressed together are reported as BUTTON_CHORD instead of on their own
+  void setChords(bool enabled) {
+    m_gestures.setChords(enabled);
+  }
+
+  // Must be changed before start()
+  GestureTimings& gestureTimings() {
+    return m_gestures.timings();
+  }
+
   void start(bool async) {
     using namespace std::chrono_literals;
     if (!m_started) {
       m_started = true;
+      if (!m_hardware) {
+        m_hardware.reset(new SysfsHardware());
+      }
 
       // Check Relay On/Off state and temp/humidity every 500ms
       m_scheduler.Schedule(500ms, [this] (tsc::TaskContext c) {
         checkRelayStates();
         // Temperature
-        char buf[10] = {0}; // for re-use
-        if (checkValue(m_temperatureFd, buf, sizeof(buf), m_temperatureThreshold, m_lastTemperature) && m_cb) {
+        if (checkValue(m_hardware->readTemperature(), m_temperatureThreshold, m_lastTemperature) && m_cb) {
           m_cb->temperatureChanged(m_lastTemperature/1000.0f);
         }
         // Humidity
-        if (checkValue(m_humidityFd, buf, sizeof(buf), m_humidityThreshold, m_lastHumidity) && m_cb) {
+        if (checkValue(m_hardware->readHumidity(), m_humidityThreshold, m_lastHumidity) && m_cb) {
           m_cb->humidityChanged(m_lastHumidity/1000.0f);
         }
         c.Repeat();
@@ -105,12 +163,14 @@ public:
     }
   }
 
-  bool setRelay(int relay, bool enabled) {
+  // since, when set, is when the request arrived; the time until the gpio write goes into relayLatency()
+  bool setRelay(int relay, bool enabled, std::chrono::steady_clock::time_point since = std::chrono::steady_clock::time_point()) {
     if (relay == 0 || relay == 1) {
-      m_scheduler.Async([this, relay, enabled] () {
-        auto fd = m_relayFds[relay];
-        lseek(fd, 0, SEEK_SET);
-        write(fd, enabled ? "1":"0", 1);
+      post([this, relay, enabled, since] () {
+        m_hardware->writeRelay(relay, enabled ? '1' : '0');
+        if (since != std::chrono::steady_clock::time_point()) {
+          m_relayLatency.recordSince(since);
+        }
       });
       return true;
     }
@@ -119,19 +179,15 @@ public:
 
   bool toggleRelay(int relay) {
     if (relay == 0 || relay == 1) {
-      m_scheduler.Async([this, relay] () {
-        char state;
-        auto fd = m_relayFds[relay];
+      post([this, relay] () {
         // read state then flip
-        lseek(fd, 0, SEEK_SET);
-        read(fd, &state, 1);
-        lseek(fd, 0, SEEK_SET);
+        char state = m_hardware->readRelay(relay);
         if (state == '0') {
           state = '1';
         } else {
           state = '0';
         }
-        write(fd, &state, 1);
+        m_hardware->writeRelay(relay, state);
       });
       return true;
     }
@@ -139,29 +195,23 @@ public:
   }
 
   void setScreen(bool enabled) {
-    m_scheduler.Async([this, enabled]() {
+    post([this, enabled]() {
       screenPower(enabled);
     });
   }
 
   // Reset state in order to trigger new events
   void resetState() {
-    m_scheduler.Async([this]() {
+    post([this]() {
       clearStates();
     });
   }
 
   void toggleTouchInput() {
-    m_scheduler.Async([this]() {
+    post([this]() {
       bool state = m_inputGrabbed;
-      if (state) {
-        if (ioctl(m_inputFd, EVIOCGRAB, 0) == 0) {
-          m_inputGrabbed = false;
-        }
-      } else {
-        if (ioctl(m_inputFd, EVIOCGRAB, 1) == 0) {
-           m_inputGrabbed = true;
-        }
+      if (m_hardware->grabInput(INPUT_TOUCH, !state)) {
+        m_inputGrabbed = !state;
       }
       if (m_cb && m_inputGrabbed != state) {
         m_cb->touchInputGrabbed(m_inputGrabbed);
@@ -173,34 +223,47 @@ public:
     return m_scheduler;
   }
 
+  LatencyHistogram const& relayLatency() const {
+    return m_relayLatency;
+  }
+
+  InputReadStats const& inputStats(InputDevice device) const {
+    return m_inputStats[device];
+  }
+
+  // Queue work for the looper thread and wake it up, safe to call from any thread
+  // fn is stored inline in the scheduler's queue, see TaskScheduler::ASYNC_HANDLER_CAPACITY
+  template<typename F>
+  void post(F&& fn) {
+    m_scheduler.Async(std::forward<F>(fn));
+    uint64_t one = 1;
+    write(m_wakeFd, &one, sizeof(one));
+  }
+
 private:
   bool m_started;
   std::thread m_looper;
   RelayCallbacks* m_cb;
   tsc::TaskScheduler m_scheduler;
+  std::unique_ptr<Hardware> m_hardware;
+  LatencyHistogram m_relayLatency;
+  InputReadStats m_inputStats[INPUT_DEVICE_COUNT];
+  GestureEngine m_gestures;
   // Config
   std::chrono::seconds m_screenTimeout;
   int m_proximityThreshold = 5000;
   int m_temperatureThreshold = 100;
   int m_humidityThreshold = 100;
-  // File Handles
-  int m_temperatureFd;
-  int m_humidityFd;
-  int m_screenFd;
-  int m_relayFds[2];
   // States
-  ButtonState m_buttonStates[2] = {{0}, {0}};
   char m_relayStates[2];
   char m_screenState;
   int m_lastTemperature;
   int m_lastHumidity;
   int m_lastInput;
-  int m_inputFd;
-  bool m_inputGrabbed;
+  bool m_inputGrabbed = false;
+  int m_wakeFd;
 
   enum SchedulerGroup {
-    BUTTON_0 = 0,
-    BUTTON_1,
     SCREEN
   };
 
@@ -213,53 +276,27 @@ private:
     m_screenState = ' ';
   }
 
-  void handleButtonPress(int i) {
-    using namespace std::chrono_literals;
-    screenPower(true);
-    auto& s = m_buttonStates[i];
-    // cancel all for this button (group id)
-    m_scheduler.CancelGroup(i);
-    s.clickCount++;
-    // Using button id as Group Id
-    m_scheduler.Schedule(400ms, i, [this, i, &s] (tsc::TaskContext c) {
-      // no more events after 200ms => held
-      s.held = true;
-      if (m_cb) {
-        m_cb->buttonHeld(i, s.clickCount);
-      }
-      c.Repeat(); // send repeated held events every 500ms
-    });
-  }
-
-  void handleButtonRelease(int i) { 
-    using namespace std::chrono_literals;
-    screenPower(true);
-    auto& s = m_buttonStates[i];
-    // cancel all for this button
-    m_scheduler.CancelGroup(i);
-    if (s.held) {
-      s.held = false;
-      if (m_cb) {
-        m_cb->buttonReleased(i, s.clickCount);
-      }
-      s.clickCount = 0;
-    } else {
-      // TODO Check max clicks and send immediately
-      m_scheduler.Schedule(150ms, i, [this, i, &s] (tsc::TaskContext) {
-        // no more events after 150ms -> clicked
-        if (m_cb) {
-          m_cb->buttonClicked(i, s.clickCount);
-        }
-        s.clickCount = 0;
-      }); 
+  void dispatchGesture(Gesture const& g) {
+    if (!m_cb) {
+      return;
+    }
+    switch (g.type) {
+    case GESTURE_CLICK:
+      m_cb->buttonClicked(g.button, g.clicks, g.edge);
+      break;
+    case GESTURE_HELD:
+      m_cb->buttonHeld(g.button, g.clicks, g.tier, g.edge);
+      break;
+    case GESTURE_RELEASED:
+      m_cb->buttonReleased(g.button, g.clicks, g.edge);
+      break;
     }
   }
 
   void checkRelayStates() {
     char state;
     for (int i=0; i<2;++i) {
-      lseek(m_relayFds[i], 0, SEEK_SET);
-      if (read(m_relayFds[i], &state, 1) > 0) {
+      if ((state = m_hardware->readRelay(i)) != 0) {
         if (m_relayStates[i] != state) {
           m_relayStates[i] = state;
           if (m_cb) {
@@ -272,8 +309,7 @@ private:
 
   void checkScreenState() {
     char state;
-    lseek(m_screenFd, 0, SEEK_SET);
-    if (read(m_screenFd, &state, 1) > 0) {
+    if ((state = m_hardware->readScreen()) != 0) {
       if (m_screenState != state) {
         m_screenState = state;
         if (m_cb) {
@@ -283,8 +319,7 @@ private:
     }
   }
 
-  bool checkValue(int fd, char* buffer, int len, int threshold, int& last) {
-    int value = getInteger(fd, buffer, len);
+  bool checkValue(int value, int threshold, int& last) {
     if (abs(value - last) > threshold) {
       last = value;
       return true;
@@ -292,42 +327,47 @@ private:
     return false;
   }
 
-  int getInteger(int fd, char* buffer, int len) {
-    lseek(fd, 0, SEEK_SET);
-    if (read(fd, buffer, len) > 0) {
-      return atoi(buffer);
-    }
-    return -1;
-  }
-
   void screenPower(bool enabled) {
     using namespace std::chrono_literals;
     // Cancel previous schedules
     m_scheduler.CancelGroup(SCREEN);
     if (enabled) {
-      write(m_screenFd, "1", 1);
+      m_hardware->writeScreen('1');
       m_scheduler.Schedule(m_screenTimeout, SCREEN, [this] (tsc::TaskContext c) {
         // turn off screen
-        write(m_screenFd, "0", 1);
+        m_hardware->writeScreen('0');
         checkScreenState();
       });
     } else {
-      write(m_screenFd, "0", 1);
+      m_hardware->writeScreen('0');
     }
     checkScreenState();
   }
 
-  void consumeEvents(int fd, struct input_event* event, std::function<void(struct input_event*)> cb) {
-    while (read(fd, event, sizeof(struct input_event)) > 0) {
-      if (cb) {
-        cb(event);
+  // Reads queued events into events (INPUT_EVENT_BATCH of them) and calls cb for each.
+  // Stops after INPUT_READS_PER_WAKEUP full reads so a storm can't hold up the looper
+  template<typename Callback>
+  void consumeEvents(InputDevice device, int fd, struct input_event* events, Callback&& cb) {
+    for (int r = 0; r < INPUT_READS_PER_WAKEUP; ++r) {
+      ssize_t len = read(fd, events, INPUT_EVENT_BATCH * sizeof(struct input_event));
+      if (len <= 0) {
+        break;
+      }
+      int count = len / sizeof(struct input_event);
+      m_inputStats[device].record(count);
+      for (int i = 0; i < count; ++i) {
+        cb(&events[i]);
+      }
+      if (count < INPUT_EVENT_BATCH) {
+        // drained
+        break;
       }
     }
   }
 
-  void processTouchEvent(int fd, struct input_event* event) {
+  void processTouchEvent(int fd, struct input_event* events) {
     bool trigger = false;
-    consumeEvents(fd, event, [&trigger] (struct input_event* e) {
+    consumeEvents(INPUT_TOUCH, fd, events, [&trigger] (struct input_event* e) {
       if (e->type == EV_KEY) {
         trigger = true;
       }
@@ -337,10 +377,10 @@ private:
     }
   }
 
-  void processProximityEvent(int fd, struct input_event* event) {
+  void processProximityEvent(int fd, struct input_event* events) {
     int i = 0;
     uint16_t led_a = 0, led_b=0, led_c=0;
-    consumeEvents(fd, event, [&i, &led_a, &led_b, &led_c] (struct input_event* e) {
+    consumeEvents(INPUT_PROXIMITY, fd, events, [&i, &led_a, &led_b, &led_c] (struct input_event* e) {
       if (i == 0) { // led a
         led_a = e->value;
       } else if (i == 1) { // led b
@@ -361,8 +401,8 @@ private:
     }
   }
 
-  void processAmbientLightEvent(int fd, struct input_event* event) {
-    consumeEvents(fd, event, [] (struct input_event* e) {
+  void processAmbientLightEvent(int fd, struct input_event* events) {
+    consumeEvents(INPUT_AMBIENT_LIGHT, fd, events, [] (struct input_event* e) {
       if (e->type == EV_ABS) {
         // printf("Got ambient light event %d\n", e->value);
       }
@@ -370,8 +410,8 @@ private:
     });
   }
 
-  void processAmbientLightIREvent(int fd, struct input_event* event) {
-    consumeEvents(fd, event, [] (struct input_event* e) {
+  void processAmbientLightIREvent(int fd, struct input_event* events) {
+    consumeEvents(INPUT_AMBIENT_LIGHT_IR, fd, events, [] (struct input_event* e) {
       if (e->type == EV_ABS) {
         // printf("Got ambient light IR event %d\n", e->value);
       }
@@ -379,90 +419,136 @@ private:
     });
   }
 
+  // Milliseconds until the scheduler has work due or a gesture times out, rounded up so
+  // poll never returns just before a deadline. -1 (block) when nothing is pending.
+  int pollTimeout() {
+    using namespace std::chrono;
+    auto next = m_scheduler.TimeUntilNextTask();
+    auto deadline = std::min({ m_gestures.nextDeadline(), m_hardware->buttonDeadline(0), m_hardware->buttonDeadline(1) });
+    if (deadline != steady_clock::time_point::max()) {
+      auto until = deadline - steady_clock::now();
+      if (until < next) {
+        next = until > steady_clock::duration::zero() ? until : steady_clock::duration::zero();
+      }
+    }
+    if (next == steady_clock::duration::max()) {
+      return -1;
+    }
+    auto ms = duration_cast<milliseconds>(next);
+    if (ms < next) {
+      ++ms;
+    }
+    return ms.count() > INT_MAX ? INT_MAX : (int)ms.count();
+  }
+
   void looperThread() {
     using namespace std::chrono_literals;
-    // set edges to listen to both signals
-    writeFile(BUTTON_0_GPIO"edge", "both", 4);
-    writeFile(BUTTON_1_GPIO"edge", "both", 4);
-
-    // setup button listeners
-    const char* pollFiles[] = { BUTTON_0_GPIO"value", BUTTON_1_GPIO"value",
-                                SCREEN_INPUT_EVENTS,
-                                PROXIMITY_INPUT_EVENTS,
-                                //AMBIENT_LIGHT_INPUT_EVENTS,
-                                //AMBIENT_LIGHT_IR_INPUT_EVENTS
-                              };
-    int pollFileCount = sizeof(pollFiles) / sizeof(char*);
-    struct pollfd fdlist[pollFileCount];
+    m_hardware->open();
 
+    // buttons, then the input devices the hardware provides, then the cross-thread wakeup eventfd
+    struct pollfd fdlist[2 + INPUT_DEVICE_COUNT + 1];
+    InputDevice inputs[INPUT_DEVICE_COUNT];
+    int pollFileCount = 0;
     for (int i=0;i<2; ++i) { // gpio polling
-      fdlist[i].fd = open(pollFiles[i], O_RDONLY);
-      fdlist[i].events = POLLPRI|POLLERR;
-      fdlist[i].revents = 0;
+      fdlist[pollFileCount].fd = m_hardware->buttonFd(i);
+      fdlist[pollFileCount].events = m_hardware->buttonPollEvents()|POLLERR;
+      fdlist[pollFileCount].revents = 0;
+      ++pollFileCount;
     }
-
-    for (int i=2;i<pollFileCount; ++i) {
+    int inputCount = 0;
+    for (int d=0;d<INPUT_DEVICE_COUNT; ++d) {
       // input events
-      fdlist[i].fd = open(pollFiles[i], O_RDONLY | O_NONBLOCK);
-      fdlist[i].events = POLLIN;
-      fdlist[i].revents = 0;
+      int fd = m_hardware->inputFd((InputDevice)d);
+      if (fd < 0) {
+        continue;
+      }
+      inputs[inputCount++] = (InputDevice)d;
+      fdlist[pollFileCount].fd = fd;
+      fdlist[pollFileCount].events = POLLIN;
+      fdlist[pollFileCount].revents = 0;
+      ++pollFileCount;
     }
 
-    // opem files
-    m_relayFds[0] = open(RELAY_0_GPIO"value", O_RDWR);
-    m_relayFds[1] = open(RELAY_1_GPIO"value", O_RDWR);
-    m_temperatureFd = open(TEMPERATURE_DATA, O_RDONLY);
-    m_humidityFd = open(HUMIDITY_DATA, O_RDONLY);
-    m_screenFd = open(SCREEN_STATE, O_RDWR);
-    m_inputFd = fdlist[2].fd;
+    int wakeIndex = pollFileCount;
+    fdlist[wakeIndex].fd = m_wakeFd;
+    fdlist[wakeIndex].events = POLLIN;
+    fdlist[wakeIndex].revents = 0;
 
     // read initial button data and start fresh
-    char buf[2] = {0};
+    ButtonEdge edges[BUTTON_EDGE_BATCH]; // for re-use
     for (int i=0;i<2;++i) {
-      lseek(fdlist[i].fd, 0, SEEK_SET);
-      read(fdlist[i].fd, buf, sizeof(buf));
+      m_hardware->readButtonEdges(i, edges, BUTTON_EDGE_BATCH, std::chrono::steady_clock::now());
     }
+    auto emit = [this] (Gesture const& g) {
+      dispatchGesture(g);
+    };
+    auto readButton = [&] (int button, std::chrono::steady_clock::time_point now) {
+      int count = m_hardware->readButtonEdges(button, edges, BUTTON_EDGE_BATCH, now);
+      if (count > 0) {
+        screenPower(true);
+      }
+      for (int e=0;e<count;++e) {
+        // timeouts that fell between queued edges go first
+        m_gestures.expire(edges[e].time, emit);
+        if (edges[e].pressed) {
+          m_gestures.press(button, edges[e].time, emit);
+        } else {
+          m_gestures.release(button, edges[e].time, emit);
+        }
+      }
+    };
 
     // main loop
-    struct input_event event; // for re-use
+    struct input_event events[INPUT_EVENT_BATCH]; // for re-use
     int err;
     while (1) {
-      // Relying on poll timeout for scheduler periodic updates
-      err = poll(fdlist, pollFileCount, 50); // 50ms
+      // Sleep until the next scheduled task is due or an fd has data
+      err = poll(fdlist, pollFileCount + 1, pollTimeout());
       if (-1 == err) {
         perror("poll");
         return;
       }
       if (err > 0) {
         // No timeout with at least 1 update
+        auto now = std::chrono::steady_clock::now();
+        // the scheduler clock stood still while poll slept, bring it up to date so
+        // timers armed by the handlers below count from now
+        m_scheduler.Update();
         for (int i=0;i<pollFileCount; ++i) {
           if (i < 2) {
-            if ((fdlist[i].revents & POLLPRI) == POLLPRI) {
-              lseek(fdlist[i].fd, 0, SEEK_SET);
-              read(fdlist[i].fd, buf, sizeof(buf));
-              if (buf[0] == '0') {
-                handleButtonPress(i);
-              }
-              if (buf[0] == '1') {
-                handleButtonRelease(i);
-              }
+            if (fdlist[i].revents & m_hardware->buttonPollEvents()) {
+              readButton(i, now);
             }
           } else {
             // event data
             if ((fdlist[i].revents & POLLIN) == POLLIN) {
-              if (i == 2) {
-                processTouchEvent(fdlist[i].fd, &event);
-              } else if (i == 3) {
-                processProximityEvent(fdlist[i].fd, &event);
-              } else if (i == 4) {
-                processAmbientLightEvent(fdlist[i].fd, &event);
-              } else if (i == 5) {
-                processAmbientLightIREvent(fdlist[i].fd, &event);
+              InputDevice device = inputs[i - 2];
+              if (device == INPUT_TOUCH) {
+                processTouchEvent(fdlist[i].fd, events);
+              } else if (device == INPUT_PROXIMITY) {
+                processProximityEvent(fdlist[i].fd, events);
+              } else if (device == INPUT_AMBIENT_LIGHT) {
+                processAmbientLightEvent(fdlist[i].fd, events);
+              } else if (device == INPUT_AMBIENT_LIGHT_IR) {
+                processAmbientLightIREvent(fdlist[i].fd, events);
               }
             }
           }
         }
+        if ((fdlist[wakeIndex].revents & POLLIN) == POLLIN) {
+          // drain the counter, queued work runs in Update() below
+          uint64_t count;
+          read(m_wakeFd, &count, sizeof(count));
+        }
       } // else time out
+      auto now = std::chrono::steady_clock::now();
+      for (int i=0;i<2;++i) {
+        // a level that settled without another edge
+        if (m_hardware->buttonDeadline(i) <= now) {
+          readButton(i, now);
+        }
+      }
+      m_gestures.expire(now, emit);
       m_scheduler.Update();
     }
   }